@@ -0,0 +1,486 @@
+// Generic delegation server: one thread owns a State and executes typed
+// operations on it on behalf of its clients.
+//
+// An operation is a trivially copyable type Op with a member type Result
+// (which may be void) and a const call operator Result operator()(State&).
+// Its data members are the arguments, they travel inline in the client
+// slot, and so does the result. The server dispatches over the list Ops
+// at compile time, there are no virtual calls or std::function involved.
+//
+// An operation with a member static constexpr bool readOnly = true and a
+// call operator taking State const& is a read. Reads are not delegated,
+// the calling thread runs them itself against the state under a seqlock
+// which the server bumps around every write, and retries them when a
+// write came in between. So a read may see a half written state, whose
+// result is then thrown away, and it must not follow pointers which a
+// write may invalidate. A read must only touch state which is safe to
+// read concurrently with a write, such as atomics accessed with
+// memory_order_relaxed (see TableState in servertest.cpp).
+
+#ifndef DELEGATION_H
+#define DELEGATION_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <xmmintrin.h>
+#include <sys/mman.h>
+
+// Lock-free registry of client slots which are scanned by one server
+// thread.
+//
+// The clients are published in an array of fixed capacity, which the
+// server scans up to size(). Registration pops a free index off a tagged
+// Treiber stack (or takes a fresh one) and publishes the client there,
+// unregistration clears the entry and pushes the index on a stack of
+// retired ones. Neither ever waits for the server. At the beginning of
+// each pass the server calls reclaim(), which deletes the retired clients
+// (the server cannot hold a reference to them any more, so this is RCU
+// with the server pass as grace period), lets the server reset its state
+// for their indices and makes the indices free for reuse.
+//
+// Clients must be allocated so that Deleter can free them (with new for
+// the default), start with all ticks 0 and must not have a request
+// outstanding when they unregister. The registry owns them from
+// unregistration on.
+template <typename C, typename Deleter = std::default_delete<C>>
+class ClientRegistry {
+  Deleter deleter;
+  uint32_t capacity;
+  std::unique_ptr<std::atomic<C*>[]> slots;
+  std::unique_ptr<C*[]> retiredClients;
+  std::unique_ptr<std::atomic<uint32_t>[]> links;  // index + 1 of the next
+                                                   // entry on either stack
+  alignas(128) std::atomic<uint32_t> used;         // indices handed out
+  alignas(128) std::atomic<uint64_t> freeHead;     // tag << 32 | index + 1
+  alignas(128) std::atomic<uint32_t> retiredHead;  // index + 1
+  char padding[124];
+
+ public:
+  explicit ClientRegistry(uint32_t cap, Deleter d = Deleter())
+    : deleter(d), capacity(cap), slots(new std::atomic<C*>[cap]),
+      retiredClients(new C*[cap]), links(new std::atomic<uint32_t>[cap]),
+      used(0), freeHead(0), retiredHead(0) {
+    for (uint32_t i = 0; i < cap; ++i) {
+      slots[i].store(nullptr, std::memory_order_relaxed);
+      retiredClients[i] = nullptr;
+      links[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  ~ClientRegistry() {
+    reclaim([](uint32_t) { });
+  }
+
+  // Publish c, returns its index or ~0u if the registry is full:
+  uint32_t add(C* c) {
+    uint32_t index;
+    uint64_t h = freeHead.load(std::memory_order_acquire);
+    while (true) {
+      uint32_t top = static_cast<uint32_t>(h);
+      if (top == 0) {
+        uint32_t u = used.load(std::memory_order_relaxed);
+        do {
+          if (u >= capacity) {
+            return ~0u;
+          }
+        } while (!used.compare_exchange_weak(u, u + 1,
+                                             std::memory_order_relaxed));
+        index = u;
+        break;
+      }
+      uint32_t next = links[top - 1].load(std::memory_order_relaxed);
+      uint64_t nh = (((h >> 32) + 1) << 32) | next;
+      if (freeHead.compare_exchange_weak(h, nh, std::memory_order_acquire,
+                                         std::memory_order_acquire)) {
+        index = top - 1;
+        break;
+      }
+    }
+    slots[index].store(c, std::memory_order_release);
+    return index;
+  }
+
+  // Withdraw the client at index, it is deleted later by the server:
+  void remove(uint32_t index) {
+    retiredClients[index] = slots[index].load(std::memory_order_relaxed);
+    slots[index].store(nullptr, std::memory_order_release);
+    uint32_t h = retiredHead.load(std::memory_order_relaxed);
+    do {
+      links[index].store(h, std::memory_order_relaxed);
+    } while (!retiredHead.compare_exchange_weak(h, index + 1,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed));
+  }
+
+  // Upper bound for the indices in use:
+  uint32_t size() const {
+    return used.load(std::memory_order_acquire);
+  }
+
+  C* get(uint32_t index) const {
+    return slots[index].load(std::memory_order_acquire);
+  }
+
+  // Whether there are retired clients which reclaim() would delete:
+  bool hasRetired() const {
+    return retiredHead.load(std::memory_order_relaxed) != 0;
+  }
+
+  // Only for the server thread, at the beginning of a pass. Deletes the
+  // retired clients and calls recycle(index) before an index is reused:
+  template <typename F>
+  void reclaim(F recycle) {
+    if (retiredHead.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    uint32_t r = retiredHead.exchange(0, std::memory_order_acquire);
+    while (r != 0) {
+      uint32_t index = r - 1;
+      r = links[index].load(std::memory_order_relaxed);
+      deleter(retiredClients[index]);
+      retiredClients[index] = nullptr;
+      recycle(index);
+      uint64_t h = freeHead.load(std::memory_order_relaxed);
+      uint64_t nh;
+      do {
+        links[index].store(static_cast<uint32_t>(h),
+                           std::memory_order_relaxed);
+        nh = (((h >> 32) + 1) << 32) | (index + 1);
+      } while (!freeHead.compare_exchange_weak(h, nh,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+    }
+  }
+};
+
+// Pool of client slots in one contiguous region, backed by 2 MiB huge
+// pages where the system has them (explicit ones, else transparent ones).
+// Slots are handed out lowest index first, so when clients register in
+// the order they get their slots, the server's scan walks the region
+// front to back and a few TLB entries cover all of it. A released slot is
+// the first to be reused if it is the lowest free one.
+template <typename C>
+class SlotPool {
+  static constexpr size_t hugePageSize = 2 << 20;
+
+  size_t bytes;                  // size of the region, 0 if mapping failed
+  unsigned char* region;
+  bool hugetlb;                  // explicit huge pages
+  uint32_t nrWords;
+  std::unique_ptr<std::atomic<uint64_t>[]> freeSlots;  // bit set if free
+
+ public:
+  explicit SlotPool(uint32_t cap)
+    : bytes((cap * sizeof(C) + hugePageSize - 1) / hugePageSize *
+            hugePageSize),
+      region(nullptr), hugetlb(false), nrWords((cap + 63) / 64),
+      freeSlots(new std::atomic<uint64_t>[nrWords]) {
+    for (uint32_t w = 0; w < nrWords; ++w) {
+      uint32_t n = cap - w * 64;
+      freeSlots[w].store(n >= 64 ? ~0ULL : (1ULL << n) - 1,
+                         std::memory_order_relaxed);
+    }
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      region = static_cast<unsigned char*>(p);
+      hugetlb = true;
+      return;
+    }
+    // Map one huge page more, cut it down to an aligned region and ask for
+    // transparent huge pages there:
+    p = mmap(nullptr, bytes + hugePageSize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      bytes = 0;
+      return;
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(p);
+    uintptr_t aligned = (start + hugePageSize - 1) & ~(hugePageSize - 1);
+    if (aligned != start) {
+      munmap(p, aligned - start);
+    }
+    munmap(reinterpret_cast<void*>(aligned + bytes),
+           hugePageSize - (aligned - start));
+    region = reinterpret_cast<unsigned char*>(aligned);
+    madvise(region, bytes, MADV_HUGEPAGE);
+  }
+
+  ~SlotPool() {
+    if (region != nullptr) {
+      munmap(region, bytes);
+    }
+  }
+
+  SlotPool(SlotPool const&) = delete;
+  SlotPool& operator=(SlotPool const&) = delete;
+
+  bool valid() const {
+    return region != nullptr;
+  }
+
+  // Whether the region lies on explicit huge pages:
+  bool hugePages() const {
+    return hugetlb;
+  }
+
+  bool owns(C const* c) const {
+    auto p = reinterpret_cast<unsigned char const*>(c);
+    return p >= region && p < region + bytes;
+  }
+
+  // Construct a client in the lowest free slot, returns nullptr if there
+  // is none:
+  template <typename... Args>
+  C* create(Args&&... args) {
+    if (region == nullptr) {
+      return nullptr;
+    }
+    for (uint32_t w = 0; w < nrWords; ++w) {
+      uint64_t bits = freeSlots[w].load(std::memory_order_relaxed);
+      while (bits != 0) {
+        uint64_t bit = bits & (~bits + 1);
+        if (freeSlots[w].compare_exchange_weak(bits, bits & ~bit,
+                                               std::memory_order_acquire,
+                                               std::memory_order_relaxed)) {
+          size_t index = w * 64 + __builtin_ctzll(bit);
+          return new (region + index * sizeof(C))
+                 C(std::forward<Args>(args)...);
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  // Destroy c and put its slot back, c must be owned by the pool:
+  void destroy(C* c) {
+    size_t index = (reinterpret_cast<unsigned char*>(c) - region) /
+                   sizeof(C);
+    c->~C();
+    freeSlots[index >> 6].fetch_or(1ULL << (index & 63),
+                                   std::memory_order_release);
+  }
+};
+
+template <typename State, typename... Ops>
+class DelegationServer {
+  template <typename Op>
+  static constexpr size_t resultSize() {
+    if constexpr (std::is_void_v<typename Op::Result>) {
+      return 1;
+    } else {
+      return sizeof(typename Op::Result);
+    }
+  }
+
+  static constexpr size_t maxOf(std::initializer_list<size_t> l) {
+    size_t m = 0;
+    for (size_t x : l) {
+      m = x > m ? x : m;
+    }
+    return m;
+  }
+
+  template <typename Op>
+  static constexpr size_t resultAlign() {
+    if constexpr (std::is_void_v<typename Op::Result>) {
+      return 1;
+    } else {
+      return alignof(typename Op::Result);
+    }
+  }
+
+  template <typename Op>
+  static constexpr bool isRead() {
+    if constexpr (requires { Op::readOnly; }) {
+      return Op::readOnly;
+    } else {
+      return false;
+    }
+  }
+
+  static constexpr bool hasReads = (isRead<Ops>() || ...);
+  static constexpr size_t argsSize = maxOf({sizeof(Ops)...});
+  static constexpr size_t resultsSize = maxOf({resultSize<Ops>()...});
+
+ public:
+  static_assert(sizeof...(Ops) > 0, "need at least one operation");
+  static_assert((std::is_trivially_copyable_v<Ops> && ...),
+                "operations must be trivially copyable");
+  static_assert(argsSize <= 120, "operation too large for a client slot");
+  static_assert(resultsSize <= 120, "result too large for a client slot");
+  static_assert(((alignof(Ops) <= 8) && ...),
+                "operations must not need more than 8 byte alignment");
+  static_assert(((resultAlign<Ops>() <= 8) && ...),
+                "results must not need more than 8 byte alignment");
+
+  struct alignas(128) Client {
+    std::atomic<uint32_t> inTick;  // starts as 0, an increase means that
+                                   // a new operation has to be done
+    uint32_t op;                   // index of the operation in Ops
+    alignas(8) unsigned char args[120];
+    std::atomic<uint32_t> outTick; // starts as 0, an increase means that
+                                   // a new result is there
+    uint32_t slot;                 // index in the registry
+    alignas(8) unsigned char result[120];
+    Client() : inTick(0), op(0), outTick(0), slot(0) { }
+  };
+
+  // Index of Op in Ops:
+  template <typename Op>
+  static constexpr uint32_t indexOf() {
+    constexpr bool found[] = {std::is_same_v<Op, Ops>...};
+    for (uint32_t i = 0; i < sizeof...(Ops); ++i) {
+      if (found[i]) {
+        return i;
+      }
+    }
+    return sizeof...(Ops);
+  }
+
+ private:
+  ClientRegistry<Client> registry;
+  std::vector<uint32_t> ticks;    // server's copy of inTick per index
+  std::atomic<uint32_t> stop;
+  alignas(128) std::atomic<uint32_t> version;  // seqlock, odd during writes
+  alignas(128) State state;       // only written by the server thread
+  std::thread server;
+
+ public:
+  template <typename... Args>
+  explicit DelegationServer(uint32_t capacity, Args&&... args)
+    : registry(capacity), ticks(capacity, 0), stop(0), version(0),
+      state(std::forward<Args>(args)...),
+      server(&DelegationServer::run, this) { }
+
+  ~DelegationServer() {
+    stop = 1;
+    server.join();
+  }
+
+  // Returns false if there is no room for another client:
+  bool registerClient(Client* c) {
+    c->slot = registry.add(c);
+    return c->slot != ~0u;
+  }
+
+  // Hands c over to the server, which deletes it:
+  void unregisterClient(Client* c) {
+    registry.remove(c->slot);
+  }
+
+  // Have the server execute op on the state and wait for its result, or
+  // run it here if it is a read:
+  template <typename Op>
+  typename Op::Result call(Client* cl, Op const& op) {
+    constexpr uint32_t index = indexOf<Op>();
+    static_assert(index < sizeof...(Ops), "operation not served");
+    if constexpr (isRead<Op>()) {
+      return read(op);
+    } else {
+      new (cl->args) Op(op);
+      cl->op = index;
+      uint32_t t = cl->inTick.load(std::memory_order_relaxed) + 1;
+      cl->inTick.store(t, std::memory_order_release);
+      while (cl->outTick.load(std::memory_order_acquire) != t) {
+      }
+      if constexpr (!std::is_void_v<typename Op::Result>) {
+        using Result = typename Op::Result;
+        return *std::launder(reinterpret_cast<Result*>(cl->result));
+      }
+    }
+  }
+
+  // Run the read op against the state, retry until no write interfered:
+  template <typename Op>
+  typename Op::Result read(Op const& op) const {
+    static_assert(isRead<Op>(), "only reads bypass the server");
+    while (true) {
+      uint32_t v = version.load(std::memory_order_acquire);
+      if ((v & 1) != 0) {
+        _mm_pause();
+        continue;
+      }
+      if constexpr (std::is_void_v<typename Op::Result>) {
+        op(state);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (version.load(std::memory_order_relaxed) == v) {
+          return;
+        }
+      } else {
+        typename Op::Result r = op(state);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (version.load(std::memory_order_relaxed) == v) {
+          return r;
+        }
+      }
+    }
+  }
+
+ private:
+  template <size_t I>
+  void execute(Client* cl) {
+    using Op = std::tuple_element_t<I, std::tuple<Ops...>>;
+    Op const& op = *std::launder(reinterpret_cast<Op const*>(cl->args));
+    constexpr bool bump = hasReads && !isRead<Op>();
+    uint32_t v = version.load(std::memory_order_relaxed);
+    if constexpr (bump) {
+      version.store(v + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+    if constexpr (std::is_void_v<typename Op::Result>) {
+      op(state);
+    } else {
+      new (cl->result) typename Op::Result(op(state));
+    }
+    if constexpr (bump) {
+      version.store(v + 2, std::memory_order_release);
+    }
+  }
+
+  template <size_t... I>
+  void dispatch(Client* cl, std::index_sequence<I...>) {
+    (void) ((cl->op == I ? (execute<I>(cl), true) : false) || ...);
+  }
+
+  void run() {
+    while (true) {
+      registry.reclaim([this](uint32_t i) { ticks[i] = 0; });
+
+      // Usual work:
+      uint32_t s = registry.size();
+      for (uint32_t i = 0; i < s; ++i) {
+        Client* cl = registry.get(i);
+        if (i + 1 < s) {
+          _mm_prefetch(reinterpret_cast<char const*>(registry.get(i + 1)),
+                       _MM_HINT_T0);
+        }
+        if (cl == nullptr) {
+          continue;
+        }
+        uint32_t t = cl->inTick.load(std::memory_order_acquire);
+        if (t != ticks[i]) {
+          ticks[i] = t;
+          dispatch(cl, std::index_sequence_for<Ops...>());
+          cl->outTick.store(t, std::memory_order_release);
+        }
+      }
+
+      // Stop?
+      if (stop.load(std::memory_order_relaxed) > 0) {
+        break;
+      }
+    }
+  }
+};
+
+#endif
@@ -4,14 +4,42 @@
 #include <fstream>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
 #include <condition_variable>
 #include <chrono>
 #include <string>
 #include <vector>
+#include <set>
+#include <queue>
+#include <algorithm>
+#include <sstream>
+#include <unordered_map>
 #include <atomic>
+#include <memory>
+#include <optional>
+#include <coroutine>
+#include <exception>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
+#include <random>
 #include <xmmintrin.h>
+#include <x86intrin.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include <time.h>
+#include <signal.h>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "delegation.h"
 
 std::string pretty(uint64_t u) {
   if (u == 0) {
@@ -31,356 +59,4764 @@ std::string pretty(uint64_t u) {
   return r;
 }
 
+// The kinds of work a Work object can do. Sum is a register-only loop of
+// howmuch iterations. The others operate on shared data of about
+// footprint bytes, which stays hot in the cache of a delegation server
+// but has to move between the cores under a lock. For them a unit of work
+// is howmuch operations on the data:
+enum class WorkKind {
+  Sum,            // s += i * i
+  HashMap,        // insert or update a random key, open addressing
+  PriorityQueue,  // push a random value, pop the top
+  PointerChase,   // follow and bump a random cycle of cache lines
+  Fifo            // push at the head, pop at the tail of a bounded ring
+};
+
+char const* workKindName(WorkKind k) {
+  switch (k) {
+    case WorkKind::Sum:           return "sum";
+    case WorkKind::HashMap:       return "hashmap";
+    case WorkKind::PriorityQueue: return "pqueue";
+    case WorkKind::PointerChase:  return "chase";
+    case WorkKind::Fifo:          return "fifo";
+  }
+  return "?";
+}
+
 class Work {
+  WorkKind kind;
   size_t howmuch;
+  size_t footprint;   // in bytes, for all kinds but Sum
   size_t sum;
+  uint64_t rng;       // xorshift64 state for the random kinds
+
+  // HashMap: pairs of key + 1 (0 is empty) and value, at most half full:
+  std::vector<uint64_t> table;
+  // PriorityQueue:
+  std::priority_queue<uint64_t> heap;
+  // PointerChase: one node per cache line, linked into a single cycle:
+  struct alignas(64) Node {
+    uint32_t next;
+    uint64_t payload;
+  };
+  std::vector<Node> nodes;
+  uint32_t position;
+  // Fifo: ring buffer, kept half full:
+  std::vector<uint64_t> ring;
+  size_t head;
+  size_t tail;
+
+  uint64_t random() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+  }
+
+  uint64_t randomKey() {
+    return random() % (table.size() / 4);
+  }
+
+  size_t hashSlot(uint64_t key) const {
+    return (key * 0x9e3779b97f4a7c15ULL >> 17) & (table.size() / 2 - 1);
+  }
+
+  // Insert or update key, probing linearly from slot i:
+  void hashMapUpdate(uint64_t key, size_t i) {
+    size_t mask = table.size() / 2 - 1;
+    while (table[2 * i] != 0 && table[2 * i] != key + 1) {
+      i = (i + 1) & mask;
+    }
+    table[2 * i] = key + 1;
+    sum += ++table[2 * i + 1];
+  }
+
+  void hashMapOp() {
+    uint64_t key = randomKey();
+    hashMapUpdate(key, hashSlot(key));
+  }
+
+  // n units of Sum at once, the units run side by side in the lanes of a
+  // vector register, 8 with AVX-512 and 4 with AVX2. Every lane does what
+  // dowork() does, so the sum is the same as with single units. (GCC 12
+  // warns about the undefined source operand in _mm512_mul_epu32 itself.)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+  void sumBatch(size_t n) {
+    size_t r = 0;
+#if defined(__AVX512F__)
+    for (; r + 8 <= n; r += 8) {
+      __m512i acc = _mm512_setzero_si512();
+      __m512i idx = _mm512_setzero_si512();
+      __m512i const one = _mm512_set1_epi64(1);
+      for (size_t i = 0; i < howmuch; ++i) {
+        acc = _mm512_add_epi64(acc, _mm512_mul_epu32(idx, idx));
+        idx = _mm512_add_epi64(idx, one);
+      }
+      uint64_t lanes[8];
+      _mm512_storeu_si512(lanes, acc);
+      for (size_t l = 0; l < 8; ++l) {
+        sum += lanes[l];
+      }
+    }
+#elif defined(__AVX2__)
+    for (; r + 4 <= n; r += 4) {
+      __m256i acc = _mm256_setzero_si256();
+      __m256i idx = _mm256_setzero_si256();
+      __m256i const one = _mm256_set1_epi64x(1);
+      for (size_t i = 0; i < howmuch; ++i) {
+        acc = _mm256_add_epi64(acc, _mm256_mul_epu32(idx, idx));
+        idx = _mm256_add_epi64(idx, one);
+      }
+      uint64_t lanes[4];
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+      sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif
+    for (; r < n; ++r) {
+      dowork();
+    }
+  }
+#pragma GCC diagnostic pop
+
+  // n units of HashMap at once with grouped probes: compute the slots of a
+  // group of keys and prefetch them all before the first probe, so that
+  // the cache misses of the group overlap instead of coming one by one:
+  void hashMapBatch(size_t n) {
+    size_t const group = 8;
+    uint64_t keys[group];
+    size_t slots[group];
+    size_t ops = n * howmuch;
+    for (size_t done = 0; done < ops; done += group) {
+      size_t g = std::min(group, ops - done);
+      for (size_t k = 0; k < g; ++k) {
+        keys[k] = randomKey();
+        slots[k] = hashSlot(keys[k]);
+        _mm_prefetch(reinterpret_cast<char const*>(&table[2 * slots[k]]),
+                     _MM_HINT_T0);
+      }
+      for (size_t k = 0; k < g; ++k) {
+        hashMapUpdate(keys[k], slots[k]);
+      }
+    }
+  }
+
+  void priorityQueueOp() {
+    heap.push(random());
+    sum += heap.top();
+    heap.pop();
+  }
+
+  void pointerChaseOp() {
+    Node& n = nodes[position];
+    sum += ++n.payload;
+    position = n.next;
+  }
+
+  void fifoOp() {
+    ring[head] = random();
+    head = head + 1 == ring.size() ? 0 : head + 1;
+    sum += ring[tail];
+    tail = tail + 1 == ring.size() ? 0 : tail + 1;
+  }
+
+  // Round n down to a power of two, but at least min:
+  static size_t powerOfTwo(size_t n, size_t min) {
+    size_t p = min;
+    while (2 * p <= n) {
+      p *= 2;
+    }
+    return p;
+  }
 
  public:
-  Work(size_t h) : howmuch(h), sum(0) {
+  Work(size_t h) : Work(WorkKind::Sum, h, 0) {
+  }
+
+  Work(WorkKind k, size_t h, size_t f)
+    : kind(k), howmuch(h), footprint(f), sum(0), rng(0x2545f4914f6cdd1dULL),
+      position(0), head(0), tail(0) {
+    switch (kind) {
+      case WorkKind::Sum:
+        break;
+      case WorkKind::HashMap:
+        table.assign(2 * powerOfTwo(footprint / 16, 16), 0);
+        break;
+      case WorkKind::PriorityQueue:
+        for (size_t i = 0; i < std::max<size_t>(footprint / 8, 1); ++i) {
+          heap.push(random());
+        }
+        break;
+      case WorkKind::PointerChase: {
+        // Sattolo's shuffle gives a random permutation with a single cycle:
+        size_t n = std::max<size_t>(footprint / sizeof(Node), 2);
+        std::vector<uint32_t> order(n);
+        for (size_t i = 0; i < n; ++i) {
+          order[i] = i;
+        }
+        for (size_t i = n - 1; i > 0; --i) {
+          std::swap(order[i], order[random() % i]);
+        }
+        nodes.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+          nodes[order[i]].next = order[(i + 1) % n];
+          nodes[order[i]].payload = 0;
+        }
+        break;
+      }
+      case WorkKind::Fifo:
+        ring.assign(std::max<size_t>(footprint / 8, 2), 0);
+        head = ring.size() / 2;
+        break;
+    }
   }
 
   void dowork() {
-    size_t s = 0;
-    for (size_t i = 0; i < howmuch; ++i) {
-      s += i * i;
+    switch (kind) {
+      case WorkKind::Sum: {
+        size_t s = 0;
+        for (size_t i = 0; i < howmuch; ++i) {
+          s += i * i;
+        }
+        sum += s;
+        break;
+      }
+      case WorkKind::HashMap:
+        for (size_t i = 0; i < howmuch; ++i) {
+          hashMapOp();
+        }
+        break;
+      case WorkKind::PriorityQueue:
+        for (size_t i = 0; i < howmuch; ++i) {
+          priorityQueueOp();
+        }
+        break;
+      case WorkKind::PointerChase:
+        for (size_t i = 0; i < howmuch; ++i) {
+          pointerChaseOp();
+        }
+        break;
+      case WorkKind::Fifo:
+        for (size_t i = 0; i < howmuch; ++i) {
+          fifoOp();
+        }
+        break;
+    }
+  }
+
+  // Do n units of work in one go, with a batch kernel where the kind has
+  // one:
+  void doworkBatch(size_t n) {
+    switch (kind) {
+      case WorkKind::Sum:
+        sumBatch(n);
+        break;
+      case WorkKind::HashMap:
+        hashMapBatch(n);
+        break;
+      default:
+        for (size_t i = 0; i < n; ++i) {
+          dowork();
+        }
+        break;
     }
-    sum += s;
   }
 
   size_t get() {
     return sum;
   }
 
+  WorkKind getKind() const {
+    return kind;
+  }
+
+  size_t getFootprint() const {
+    return footprint;
+  }
 };
 
 double workTime = 0.0;   // time in seconds for one piece of work, will be
                          // gauged at beginning of program
 
-void singleThread(Work* work, std::atomic<int>* stop, uint64_t* count) {
-  // simply work until stop is signalled:
-  uint64_t c = 0;
-  size_t perRound = ceill(1e-5 / workTime);
-  while (stop->load() == 0) {
-    for (size_t i = 0; i < perRound; ++i) {
-      work->dowork();
-      ++c;
+std::atomic<uint64_t> resultSink(0);  // results read by clients end up here,
+                                      // so that they are not optimized out
+
+double tscPerNs = 1.0;   // TSC ticks per nanosecond, will be gauged at
+                         // beginning of program
+
+// Log-linear histogram of TSC tick counts. Values below 2^subBits are
+// counted exactly, above that every power of two is split into 2^subBits
+// linear buckets, so the relative error is below 1/2^subBits. Recording
+// is a count-leading-zeros and an increment.
+class Histogram {
+  static constexpr unsigned subBits = 5;
+  static constexpr unsigned nrBuckets = (64 - subBits + 1) << subBits;
+  uint64_t counts[nrBuckets];
+  uint64_t total;
+  uint64_t maxValue;
+
+  static unsigned bucket(uint64_t v) {
+    if (v < (1u << subBits)) {
+      return static_cast<unsigned>(v);
     }
+    unsigned shift = 63 - __builtin_clzll(v) - subBits;
+    return ((shift + 1) << subBits) +
+           static_cast<unsigned>((v >> shift) & ((1u << subBits) - 1));
   }
-  *count = c;
+
+  // Largest value which falls into bucket b:
+  static uint64_t upperBound(unsigned b) {
+    if (b < (1u << subBits)) {
+      return b;
+    }
+    unsigned shift = (b >> subBits) - 1;
+    uint64_t low = ((1ULL << subBits) + (b & ((1u << subBits) - 1))) << shift;
+    return low + ((1ULL << shift) - 1);
+  }
+
+ public:
+  Histogram() : total(0), maxValue(0) {
+    for (unsigned i = 0; i < nrBuckets; ++i) {
+      counts[i] = 0;
+    }
+  }
+
+  void record(uint64_t v) {
+    ++counts[bucket(v)];
+    ++total;
+    if (v > maxValue) {
+      maxValue = v;
+    }
+  }
+
+  // Record the TSC ticks since last and return the current TSC:
+  uint64_t recordSince(uint64_t last) {
+    uint64_t now = __rdtsc();
+    record(now - last);
+    return now;
+  }
+
+  void merge(Histogram const& other) {
+    for (unsigned i = 0; i < nrBuckets; ++i) {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+    if (other.maxValue > maxValue) {
+      maxValue = other.maxValue;
+    }
+  }
+
+  uint64_t count() const {
+    return total;
+  }
+
+  // Value (in ticks) below or at which a fraction q of all values lie:
+  uint64_t percentile(double q) const {
+    uint64_t rank = static_cast<uint64_t>(ceill(q * total));
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < nrBuckets; ++i) {
+      seen += counts[i];
+      if (seen >= rank && seen > 0) {
+        uint64_t u = upperBound(i);
+        return u < maxValue ? u : maxValue;
+      }
+    }
+    return maxValue;
+  }
+
+  uint64_t max() const {
+    return maxValue;
+  }
+};
+
+// Gauge how fast the TSC runs against the system clock:
+void calibrateTsc() {
+  std::chrono::high_resolution_clock clock;
+  auto startTime = clock.now();
+  uint64_t startTsc = __rdtsc();
+  std::this_thread::sleep_for(std::chrono::duration<double>(0.1));
+  uint64_t endTsc = __rdtsc();
+  std::chrono::duration<double> runTime = clock.now() - startTime;
+  tscPerNs = (endTsc - startTsc) / (runTime.count() * 1e9);
+}
+
+// Nanoseconds for a number of TSC ticks, in human readable form:
+std::string tscToNs(uint64_t ticks) {
+  return pretty(static_cast<uint64_t>(ticks / tscPerNs));
+}
+
+// Print the percentiles of the round trip times in h:
+void printLatencies(Histogram const& h) {
+  if (h.count() == 0) {
+    return;
+  }
+  std::cout << "  latency: p50=" << tscToNs(h.percentile(0.5))
+    << " ns p99=" << tscToNs(h.percentile(0.99))
+    << " ns p99.9=" << tscToNs(h.percentile(0.999))
+    << " ns max=" << tscToNs(h.max()) << " ns" << std::endl;
 }
 
-void multipleThreads(Work* work, std::mutex* mutex, std::atomic<int>* stop,
-                     uint64_t* count) {
-  // simply work until stop is signalled, but with a mutex:
+void singleThread(Work* work, std::atomic<int>* stop, uint64_t* count,
+                  Histogram* hist) {
+  // simply work until stop is signalled:
   uint64_t c = 0;
+  Histogram h;
+  uint64_t last = __rdtsc();
   size_t perRound = ceill(1e-5 / workTime);
   while (stop->load() == 0) {
     for (size_t i = 0; i < perRound; ++i) {
-      {
-        std::unique_lock<std::mutex> guard(*mutex);
-        work->dowork();
-      }
+      work->dowork();
       ++c;
+      last = h.recordSince(last);
     }
   }
   *count = c;
+  *hist = h;
 }
 
-class Server {
- public:
-  struct alignas(128) Client {
-    std::atomic<uint32_t> inTick;  // starts as 0, an increase means that
-                                   // a new job has to be done
-    uint32_t what;    // indicates what to do
-    Work* work;
-    char padding[120 - sizeof(Work*)];
-    std::atomic<uint32_t> outTick;  // starts as 0, an increase means that
-                                    // a new answer is there
-    std::atomic<uint32_t> serverGone;
-    char padding2[124];
-    Client(Work* w) : inTick(0), what(0), work(w), outTick(0), serverGone(0) { }
+inline long futexWait(std::atomic<uint32_t>* addr, uint32_t expected) {
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr),
+                 FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+inline long futexWake(std::atomic<uint32_t>* addr, int nr) {
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr),
+                 FUTEX_WAKE_PRIVATE, nr, nullptr, nullptr, 0);
+}
+
+// Hardware performance counters for the phases of the benchmark. They
+// are opened once at program start with inherit set, so they count all
+// threads created afterwards, and are reset, enabled and disabled around
+// each phase. Counters the kernel or the container does not allow stay
+// unavailable, and without any the report is simply skipped.
+class PerfCounters {
+  struct Counter {
+    char const* name;
+    int fd;
+    uint64_t value;   // scaled for multiplexing, valid after stop()
   };
+  std::vector<Counter> counters;
 
- private:
-  std::mutex mutex;
-  std::vector<Client*> newClients;
-  std::vector<Client*> toRemove;
-  std::atomic<uint32_t> changed;  // increase to make the server look at lists
-  char padding[128];              // just to go to other cache line
+  static int openCounter(uint32_t type, uint64_t config, bool user) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = user ? 1 : 0;   // needed where paranoid >= 2
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                                    0));
+  }
 
-  std::vector<Client*> clients;
-  std::vector<uint32_t> ticks;
-  std::atomic<uint32_t> stop;
-  std::thread server;
+  // Whether the CPU has MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM as raw event
+  // 0x04d2. It is model specific: Haswell to Comet Lake have it under this
+  // code, other CPUs count something else or nothing with it:
+  static bool hasHitmEvent() {
+    std::ifstream in("/proc/cpuinfo");
+    std::string line;
+    bool intel = false;
+    int family = -1;
+    int model = -1;
+    while (std::getline(in, line) && model < 0) {
+      size_t colon = line.find(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      std::string value = line.substr(colon + 1);
+      if (line.compare(0, 9, "vendor_id") == 0) {
+        intel = value.find("GenuineIntel") != std::string::npos;
+      } else if (line.compare(0, 10, "cpu family") == 0) {
+        family = atoi(value.c_str());
+      } else if (line.compare(0, 6, "model\t") == 0) {
+        model = atoi(value.c_str());
+      }
+    }
+    static int const models[] = {
+      0x3c, 0x3f, 0x45, 0x46,         // Haswell
+      0x3d, 0x47, 0x4f, 0x56,         // Broadwell
+      0x4e, 0x5e, 0x55,               // Skylake, Cascade Lake
+      0x8e, 0x9e, 0xa5, 0xa6          // Kaby, Coffee and Comet Lake
+    };
+    return intel && family == 6 &&
+           std::find(std::begin(models), std::end(models), model) !=
+             std::end(models);
+  }
+
+  void add(char const* name, uint32_t type, uint64_t config,
+           bool user = true) {
+    int fd = openCounter(type, config, user);
+    if (fd >= 0) {
+      counters.push_back(Counter{name, fd, 0});
+    }
+  }
 
  public:
-  Server() 
-    : changed(0), stop(0), server(&Server::run, this) { }
+  void open() {
+    add("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    add("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    add("LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    if (hasHitmEvent()) {
+      // MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM, loads served from a modified
+      // line in another core's cache:
+      add("HITM", PERF_TYPE_RAW, 0x04d2);
+    }
+    add("dTLB misses", PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    // Context switches happen in the kernel, so they need kernel counting:
+    add("context switches", PERF_TYPE_SOFTWARE,
+        PERF_COUNT_SW_CONTEXT_SWITCHES, false);
+  }
 
-  ~Server() {
-    stop = 1;
-    server.join();
+  // Names of the counters which could be opened, comma separated:
+  std::string names() const {
+    std::string r;
+    for (Counter const& c : counters) {
+      if (!r.empty()) {
+        r += ",";
+      }
+      r += c.name;
+    }
+    return r;
   }
 
-  void registerClient(Client* c) {
-    std::unique_lock<std::mutex> guard(mutex);
-    newClients.push_back(c);
-    ++changed;
+  ~PerfCounters() {
+    for (Counter& c : counters) {
+      close(c.fd);
+    }
   }
 
-  void unregisterClient(Client* c) {
-    {
-      std::unique_lock<std::mutex> guard(mutex);
-      toRemove.push_back(c);
-      ++changed;
+  void start() {
+    for (Counter& c : counters) {
+      ioctl(c.fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0);
     }
-    while (changed > 0) {}
   }
 
-  void duplicatePointers() {
-    size_t size = clients.size();
-    if (size > 0) {
-      for (size_t i = 0; i < size; ++i) {
-        clients.push_back(clients[i]);   // Copy first to end
+  void stop() {
+    for (Counter& c : counters) {
+      ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0);
+      uint64_t data[3];   // value, time enabled, time running
+      c.value = 0;
+      if (read(c.fd, data, sizeof(data)) == sizeof(data) && data[2] > 0) {
+        c.value = static_cast<uint64_t>(
+          static_cast<double>(data[0]) * data[1] / data[2]);
       }
     }
   }
 
-  void removeDuplicatePointers() {
-    size_t size = clients.size();
-    if (size > 0) {  // Remove all copies of the pointers:
-      for (size_t i = 0; i < size/2; ++i) {
-        clients.pop_back();  // Remove copy
+  // Value of the counter name after the last stop(), or -1 if there is
+  // no such counter:
+  double get(char const* name) const {
+    for (Counter const& c : counters) {
+      if (strcmp(c.name, name) == 0) {
+        return static_cast<double>(c.value);
       }
     }
+    return -1.0;
   }
 
-  void run() {
+  // The counters of the last phase divided by the number of operations
+  // done in it:
+  std::vector<std::pair<std::string, double>> perOp(uint64_t ops) const {
+    std::vector<std::pair<std::string, double>> r;
+    if (ops == 0) {
+      return r;
+    }
+    for (Counter const& c : counters) {
+      r.emplace_back(c.name, static_cast<double>(c.value) / ops);
+    }
+    return r;
+  }
+};
+
+PerfCounters perf;
+
+// A zoo of locks to compare the delegating server against. All of them
+// are used through a LockHandle (see below), which a thread creates once
+// and which carries the per-thread state the queue locks need.
+
+// Test-and-test-and-set spin lock with exponential backoff:
+class TTASLock {
+  std::atomic<uint32_t> locked;
+
+ public:
+  TTASLock() : locked(0) { }
+
+  void lock() {
+    uint32_t delay = 1;
     while (true) {
-      // Usual work:
-      size_t s = clients.size();
-      if (s > 0) {  // s is always even!
-        size_t ss = s >> 1;
-        for (size_t i = 0; i < ss; ++i) {
-          _mm_prefetch(clients[i+ss], _mm_hint::_MM_HINT_T0);
-          uint32_t t = clients[i]->inTick.load(std::memory_order_relaxed);
-          if (t != ticks[i]) {
-            ticks[i] = t;
-            clients[i]->work->dowork();
-            clients[i]->outTick.store(t, std::memory_order_relaxed);
-          }
-        }
+      while (locked.load(std::memory_order_relaxed) != 0) {
+        _mm_pause();
       }
-
-      // Look after changes:
-      if (changed.load(std::memory_order_relaxed) > 0) {
-        // Mutex ensures memory barrier
-        std::unique_lock<std::mutex> guard(mutex);
-        removeDuplicatePointers();
-        for (size_t i = 0; i < toRemove.size(); ++i) {
-          for (size_t j = 0; j < clients.size(); ++j) {
-            if (toRemove[i] == clients[j]) {
-              clients[j] = clients.back();
-              clients.pop_back();
-              ticks[j] = ticks.back();
-              ticks.pop_back();
-              break;
-            }
-          }
-        }
-        toRemove.clear();
-        for (size_t i = 0; i < newClients.size(); ++i) {
-          clients.push_back(newClients[i]);
-          ticks.push_back(0);
-        }
-        newClients.clear();
-        duplicatePointers();
-        changed.store(0, std::memory_order_relaxed);  // under the mutex!
+      if (locked.exchange(1, std::memory_order_acquire) == 0) {
+        return;
       }
-
-      // Stop?
-      if (stop.load(std::memory_order_relaxed) > 0) {
-        removeDuplicatePointers();
-        if (clients.size() > 0) {
-          for (size_t i = 0; i < clients.size(); ++i) {
-            clients[i]->serverGone = 1;
-          }
-        }
-        break;
+      for (uint32_t i = 0; i < delay; ++i) {
+        _mm_pause();
+      }
+      if (delay < 1024) {
+        delay <<= 1;
       }
     }
   }
+
+  void unlock() {
+    locked.store(0, std::memory_order_release);
+  }
 };
 
-void clientThread(Server* server, Work* work, std::atomic<int>* stop,
-                  uint64_t* count) {
-  Server::Client* cl = new Server::Client(work);
-  server->registerClient(cl);
-  // simply work as client until stop is signalled:
-  uint64_t c = 0;
-  size_t perRound = ceill(1e-5 / workTime);
-  uint32_t t = 0;
-  while (stop->load(std::memory_order_relaxed) == 0) {
-    for (size_t i = 0; i < perRound; ++i) {
-      cl->inTick.store(++t, std::memory_order_relaxed);
-      while (cl->outTick.load(std::memory_order_relaxed) != t) {
-      }
-      ++c;
+// Ticket lock, hands out the lock in FIFO order:
+class TicketLock {
+  std::atomic<uint32_t> next;
+  std::atomic<uint32_t> serving;
+
+ public:
+  TicketLock() : next(0), serving(0) { }
+
+  void lock() {
+    uint32_t my = next.fetch_add(1, std::memory_order_relaxed);
+    while (serving.load(std::memory_order_acquire) != my) {
+      _mm_pause();
     }
   }
-  server->unregisterClient(cl);
-  delete cl;
-  *count = c;
-}
 
-int main(int argc, char* argv[]) {
-  // Command line arguments:
-  if (argc < 4) {
-    std::cout << "Usage: servertest DIFFICULTY TESTTIME THREADS" << std::endl;
-    return 0;
+  void unlock() {
+    // Only the holder writes serving:
+    serving.store(serving.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_release);
   }
-  size_t howmuch = std::stoul(std::string(argv[1]));
-  double testTime = std::stoul(std::string(argv[2]));
-  int threads = std::stol(std::string(argv[3]));
-  std::cout << "Difficulty: " << howmuch << std::endl;
-  std::cout << "Test time : " << testTime << std::endl;
-  std::cout << "Maximal number of threads: " << threads << "\n" << std::endl;
+};
 
-  // Work generator:
-  Work work(howmuch);
-  std::chrono::high_resolution_clock clock;
+// MCS queue lock, every waiter spins on its own node:
+class MCSLock {
+ public:
+  struct alignas(128) Node {
+    std::atomic<Node*> next;
+    std::atomic<uint32_t> locked;
+    Node() : next(nullptr), locked(0) { }
+  };
 
-  // Measure a single workload:
-  {
-    std::cout << "Measuring a single workload..." << std::endl;
-    size_t repeats = 100;
-    std::chrono::duration<double> runTime;
-    while (true) {
-      auto startTime = clock.now();
-      for (size_t i = 0; i < repeats; ++i) {
-        work.dowork();
-      }
-      auto endTime = clock.now();
-      runTime = endTime - startTime;
-      if (runTime > std::chrono::duration<double>(1)) {
-        break;
+ private:
+  std::atomic<Node*> tail;
+
+ public:
+  MCSLock() : tail(nullptr) { }
+
+  void lock(Node* n) {
+    n->next.store(nullptr, std::memory_order_relaxed);
+    n->locked.store(1, std::memory_order_relaxed);
+    Node* pred = tail.exchange(n, std::memory_order_acq_rel);
+    if (pred != nullptr) {
+      pred->next.store(n, std::memory_order_release);
+      while (n->locked.load(std::memory_order_acquire) != 0) {
+        _mm_pause();
       }
-      repeats *= 3;
     }
-    workTime = runTime.count() / repeats;
-    std::cout << "Work time for one unit of work: "
-      << floor(workTime * 1e9) << " ns\n" << std::endl;
   }
 
-  // Now measure how many workloads a single thread can do in a given time:
-  {
-    std::cout << "Running in a single thread without any locking..."
-      << std::endl;
-    std::atomic<int> stop(0);
-    uint64_t count;
-    auto startTime = clock.now();
-    std::thread t(singleThread, &work, &stop, &count);
-    std::this_thread::sleep_for(std::chrono::duration<double>(testTime));
-    stop.store(1);
-    t.join();
-    auto endTime = clock.now();
-    std::chrono::duration<double> runTime = endTime - startTime;
-    std::cout << "  time="
-      << runTime.count() << "s " << pretty(count)
-      << " iterations, time per iteration: "
-      << floorl(runTime.count() / static_cast<double>(count) * 1e9) << " ns"
-      << "\n" << std::endl;
-  }
-  
-  // Now measure how multiple threads fare when using a normal mutex:
-  {
-    std::cout << "Using multiple threads and a std::mutex..." << std::endl;
-    for (int j = 1; j <= threads; ++j) {
-      std::cout << "Using " << j << " threads:" << std::endl;
-
-      std::vector<std::thread> ts;
-      std::vector<uint64_t> counts;
-      std::mutex mutex;
-      counts.reserve(j);
-      for (int i = 0; i < j; ++i) {
-        counts.push_back(0);
-      }
-      ts.reserve(j);
-
-      std::atomic<int> stop(0);
-      auto startTime = clock.now();
-      for (int i = 0; i < j; ++i) {
-        ts.emplace_back(multipleThreads, &work, &mutex, &stop, &counts[i]);
-      }
-      std::this_thread::sleep_for(std::chrono::duration<double>(testTime));
-      stop.store(1);
-      for (int i = 0; i < j; ++i) {
-        ts[i].join();
-      }
-      auto endTime = clock.now();
-      std::chrono::duration<double> runTime = endTime - startTime;
-      uint64_t count = 0;
-      for (int i = 0; i < j; ++i) {
-        count += counts[i];
+  void unlock(Node* n) {
+    Node* succ = n->next.load(std::memory_order_acquire);
+    if (succ == nullptr) {
+      Node* expected = n;
+      if (tail.compare_exchange_strong(expected, nullptr,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+        return;
       }
-      std::cout << "  time="
-        << runTime.count() << "s " << pretty(count)
-        << " iterations, time per iteration: "
-        << floorl(runTime.count() / static_cast<double>(count) * 1e9) << " ns"
-        << std::endl;
-      std::cout << "  thread counts:";
-      for (int i = 0; i < j; ++i) {
-        std::cout << " " << pretty(counts[i]);
+      // A successor is just enqueueing itself, wait for its link:
+      while ((succ = n->next.load(std::memory_order_acquire)) == nullptr) {
+        _mm_pause();
       }
-      std::cout << "\n" << std::endl;
     }
+    succ->locked.store(0, std::memory_order_release);
   }
+};
 
-  // Measure a delegating server:
-  {
-    std::cout << "Running in a single thread with delegation..." << std::endl;
-    Server server;  // start the server thread
-    for (int j = 1; j <= threads; ++j) {
-      std::cout << "Using " << j << " threads:" << std::endl;
-      std::atomic<int> stop(0);
-      std::vector<std::thread> ts;
-      std::vector<uint64_t> counts;
-      counts.reserve(j);
-      for (int i = 0; i < j; ++i) {
-        counts.push_back(0);
-      }
-      ts.reserve(j);
-      auto startTime = clock.now();
-      for (int i = 0; i < j; ++i) {
-        ts.emplace_back(clientThread, &server, &work, &stop, &counts[i]);
-      }
-      std::this_thread::sleep_for(std::chrono::duration<double>(testTime));
-      stop.store(1);
-      for (int i = 0; i < j; ++i) {
-        ts[i].join();
+// CLH queue lock, every waiter spins on the node of its predecessor and
+// takes that node over when it releases the lock:
+class CLHLock {
+ public:
+  struct alignas(128) Node {
+    std::atomic<uint32_t> locked;
+    Node() : locked(0) { }
+  };
+
+ private:
+  std::atomic<Node*> tail;
+
+ public:
+  CLHLock() : tail(new Node()) { }
+
+  ~CLHLock() {
+    // All handles are gone, the last released node belongs to nobody:
+    delete tail.load();
+  }
+
+  Node* lock(Node* n) {
+    n->locked.store(1, std::memory_order_relaxed);
+    Node* pred = tail.exchange(n, std::memory_order_acq_rel);
+    while (pred->locked.load(std::memory_order_acquire) != 0) {
+      _mm_pause();
+    }
+    return pred;
+  }
+
+  void unlock(Node* n) {
+    n->locked.store(0, std::memory_order_release);
+  }
+};
+
+// Plain futex lock (Drepper's "mutex2"), 0 is unlocked, 1 is locked and
+// 2 is locked with possible waiters:
+class FutexLock {
+  std::atomic<uint32_t> state;
+
+ public:
+  FutexLock() : state(0) { }
+
+  void lock() {
+    uint32_t c = 0;
+    if (state.compare_exchange_strong(c, 1, std::memory_order_acquire)) {
+      return;
+    }
+    if (c != 2) {
+      c = state.exchange(2, std::memory_order_acquire);
+    }
+    while (c != 0) {
+      futexWait(&state, 2);
+      c = state.exchange(2, std::memory_order_acquire);
+    }
+  }
+
+  void unlock() {
+    if (state.fetch_sub(1, std::memory_order_release) != 1) {
+      state.store(0, std::memory_order_release);
+      futexWake(&state, 1);
+    }
+  }
+};
+
+// Per-thread access to a lock, the queue locks keep their node here.
+// Locks without a shared mode take the exclusive one for readers:
+template <typename Lock>
+class LockHandle {
+  Lock& mutex;
+
+ public:
+  explicit LockHandle(Lock& m) : mutex(m) { }
+  void lock() { mutex.lock(); }
+  void unlock() { mutex.unlock(); }
+  void lock_shared() { mutex.lock(); }
+  void unlock_shared() { mutex.unlock(); }
+};
+
+template <>
+class LockHandle<std::shared_mutex> {
+  std::shared_mutex& mutex;
+
+ public:
+  explicit LockHandle(std::shared_mutex& m) : mutex(m) { }
+  void lock() { mutex.lock(); }
+  void unlock() { mutex.unlock(); }
+  void lock_shared() { mutex.lock_shared(); }
+  void unlock_shared() { mutex.unlock_shared(); }
+};
+
+template <>
+class LockHandle<MCSLock> {
+  MCSLock& mutex;
+  MCSLock::Node node;
+
+ public:
+  explicit LockHandle(MCSLock& m) : mutex(m) { }
+  void lock() { mutex.lock(&node); }
+  void unlock() { mutex.unlock(&node); }
+  void lock_shared() { lock(); }
+  void unlock_shared() { unlock(); }
+};
+
+template <>
+class LockHandle<CLHLock> {
+  CLHLock& mutex;
+  CLHLock::Node* node;
+  CLHLock::Node* pred;
+
+ public:
+  explicit LockHandle(CLHLock& m) : mutex(m), node(new CLHLock::Node()),
+                                    pred(nullptr) { }
+  ~LockHandle() { delete node; }
+  void lock() { pred = mutex.lock(node); }
+  void unlock() {
+    mutex.unlock(node);
+    node = pred;  // our old node now belongs to our successor
+  }
+  void lock_shared() { lock(); }
+  void unlock_shared() { unlock(); }
+};
+
+// Out of every 100 operations, readPct only read the result of the work
+// under the lock in shared mode:
+template <typename Lock>
+void multipleThreads(Work* work, Lock* mutex, std::atomic<int>* stop,
+                     uint64_t* count, Histogram* hist, unsigned readPct = 0) {
+  // simply work until stop is signalled, but with a lock:
+  LockHandle<Lock> handle(*mutex);
+  uint64_t c = 0;
+  uint64_t sum = 0;
+  Histogram h;
+  uint64_t last = __rdtsc();
+  size_t perRound = ceill(1e-5 / workTime);
+  while (stop->load() == 0) {
+    for (size_t i = 0; i < perRound; ++i) {
+      if (c % 100 < readPct) {
+        std::shared_lock<LockHandle<Lock>> guard(handle);
+        sum += work->get();
+      } else {
+        std::unique_lock<LockHandle<Lock>> guard(handle);
+        work->dowork();
+      }
+      ++c;
+      last = h.recordSince(last);
+    }
+  }
+  resultSink.fetch_add(sum, std::memory_order_relaxed);
+  *count = c;
+  *hist = h;
+}
+
+// CPU topology as read from sysfs, one entry per online CPU:
+struct CpuInfo {
+  int cpu;
+  int core;      // lowest CPU number among the SMT siblings
+  int llc;       // lowest CPU number sharing the last level cache
+  int package;   // physical package (socket) id
+  int node;      // NUMA node, 0 without NUMA information
+};
+
+// Parse a sysfs CPU list like "0-3,8,10-11":
+std::vector<int> parseCpuList(std::string const& list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty() || range[0] == '\n') {
+      continue;
+    }
+    size_t dash = range.find('-');
+    int from = std::stoi(range.substr(0, dash));
+    int to = dash == std::string::npos ? from : std::stoi(range.substr(dash + 1));
+    for (int c = from; c <= to; ++c) {
+      cpus.push_back(c);
+    }
+  }
+  return cpus;
+}
+
+std::string readSysfs(std::string const& path) {
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line);
+  return line;
+}
+
+std::vector<CpuInfo> readTopology() {
+  std::vector<CpuInfo> topology;
+  // The NUMA nodes list their CPUs:
+  std::unordered_map<int, int> nodeOf;
+  std::string const nodes = "/sys/devices/system/node/";
+  for (int node : parseCpuList(readSysfs(nodes + "online"))) {
+    for (int cpu : parseCpuList(readSysfs(
+           nodes + "node" + std::to_string(node) + "/cpulist"))) {
+      nodeOf[cpu] = node;
+    }
+  }
+  std::string const base = "/sys/devices/system/cpu/";
+  for (int cpu : parseCpuList(readSysfs(base + "online"))) {
+    std::string dir = base + "cpu" + std::to_string(cpu) + "/";
+    CpuInfo info{cpu, cpu, cpu, 0, 0};
+    std::vector<int> siblings =
+      parseCpuList(readSysfs(dir + "topology/thread_siblings_list"));
+    if (!siblings.empty()) {
+      info.core = siblings[0];
+    }
+    // The highest cache index is the last level cache:
+    for (int index = 3; index >= 0; --index) {
+      std::vector<int> sharing = parseCpuList(readSysfs(
+        dir + "cache/index" + std::to_string(index) + "/shared_cpu_list"));
+      if (!sharing.empty()) {
+        info.llc = sharing[0];
+        break;
+      }
+    }
+    std::string package = readSysfs(dir + "topology/physical_package_id");
+    if (!package.empty()) {
+      info.package = std::stoi(package);
+    }
+    auto node = nodeOf.find(cpu);
+    if (node != nodeOf.end()) {
+      info.node = node->second;
+    }
+    topology.push_back(info);
+  }
+  return topology;
+}
+
+// Where the server and its clients run relative to each other:
+enum class Placement {
+  OsDefault,     // no pinning at all
+  SameCore,      // clients on SMT siblings of the server
+  SameLlc,       // clients on other cores sharing the server's LLC
+  CrossSocket,   // clients on another socket than the server
+  CrossNode      // clients on another NUMA node than the server
+};
+
+char const* placementName(Placement p) {
+  switch (p) {
+    case Placement::OsDefault:   return "OS default";
+    case Placement::SameCore:    return "same core (SMT)";
+    case Placement::SameLlc:     return "same LLC";
+    case Placement::CrossSocket: return "cross socket";
+    case Placement::CrossNode:   return "cross NUMA node";
+  }
+  return "?";
+}
+
+// Choose CPUs for the server (element 0) and the clients (the others) for
+// policy p, each client on a suitable CPU of its own. Returns an empty
+// vector if the machine does not allow the policy for that many clients,
+// and one with all entries -1 for OsDefault:
+std::vector<int> placeThreads(std::vector<CpuInfo> const& topology,
+                              Placement p, int clients) {
+  if (p == Placement::OsDefault) {
+    return std::vector<int>(clients + 1, -1);
+  }
+  for (CpuInfo const& server : topology) {
+    std::vector<int> candidates;
+    std::set<int> coresUsed;
+    for (CpuInfo const& c : topology) {
+      if (c.cpu == server.cpu) {
+        continue;
+      }
+      bool fits = false;
+      switch (p) {
+        case Placement::SameCore:
+          fits = c.core == server.core;
+          break;
+        case Placement::SameLlc:
+          // one CPU per core, so that clients do not share cores either:
+          fits = c.core != server.core && c.llc == server.llc &&
+                 coresUsed.insert(c.core).second;
+          break;
+        case Placement::CrossSocket:
+          fits = c.package != server.package &&
+                 coresUsed.insert(c.core).second;
+          break;
+        case Placement::CrossNode:
+          fits = c.node != server.node && coresUsed.insert(c.core).second;
+          break;
+        default:
+          break;
+      }
+      if (fits) {
+        candidates.push_back(c.cpu);
+      }
+    }
+    if (candidates.size() >= static_cast<size_t>(clients)) {
+      std::vector<int> cpus{server.cpu};
+      cpus.insert(cpus.end(), candidates.begin(), candidates.begin() + clients);
+      return cpus;
+    }
+  }
+  return std::vector<int>();
+}
+
+// Pin a thread to a CPU, -1 leaves it to the OS:
+void pinThread(pthread_t thread, int cpu) {
+  if (cpu < 0) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0) {
+    std::cerr << "Warning: could not pin thread to CPU " << cpu << std::endl;
+  }
+}
+
+// CPU time thread t has used so far, in seconds:
+double threadCpuTime(std::thread& t) {
+  clockid_t cid;
+  struct timespec ts;
+  if (pthread_getcpuclockid(t.native_handle(), &cid) != 0 ||
+      clock_gettime(cid, &ts) != 0) {
+    return 0.0;
+  }
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Store the answer value into the word a client waits on. If the client
+// may park (see ParkWait), it has set parked before it went to sleep on
+// word, so after a full fence one of us sees the other's store and the
+// wakeup cannot get lost:
+inline void publishAndWake(std::atomic<uint32_t>* word, uint32_t value,
+                           bool mayPark, std::atomic<uint32_t>* parked) {
+  if (!mayPark) {
+    word->store(value, std::memory_order_release);
+    return;
+  }
+  word->store(value, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (parked->load(std::memory_order_relaxed) != 0) {
+    parked->store(0, std::memory_order_relaxed);
+    futexWake(word, 1);
+  }
+}
+
+// What the server does when a pass over all clients found nothing to do.
+// It first keeps spinning for spinPasses empty passes, then pauses for an
+// exponentially growing number of pause instructions (capped at maxPause)
+// for pausePasses empty passes, and finally, if sleep is set, goes to
+// sleep on a futex until a client posts a request or (un)registers.
+struct IdlePolicy {
+  uint32_t spinPasses;
+  uint32_t pausePasses;
+  uint32_t maxPause;
+  bool sleep;
+
+  static IdlePolicy spin() {     // never back off
+    return IdlePolicy{~0u, 0, 0, false};
+  }
+  static IdlePolicy pause() {    // spin, then back off with pause
+    return IdlePolicy{1000, ~0u, 1024, false};
+  }
+  static IdlePolicy sleeping() { // spin, back off, then sleep
+    return IdlePolicy{1000, 100, 1024, true};
+  }
+};
+
+// How the server finds the clients with pending requests. Poll touches
+// the inTick line of every registered client on every pass. Doorbell has
+// every client also set its bit in a shared bitmap of pending requests,
+// and the server only visits the set bits, so a pass costs in proportion
+// to the active clients and not to the registered ones.
+enum class ScanMode { Poll, Doorbell };
+
+// In which order the server serves the requests it finds in a pass when
+// polling. InOrder goes by index, so the low indices always come first.
+// RoundRobin starts each pass one index further. Weighted serves rounds
+// of up to Server::qosWeights[k] requests of the clients of QoS class k,
+// latency critical class 0 first, and looks for new class 0 requests
+// after every round. OldestFirst serves by the time the requests were
+// posted. The last two only apply without batching:
+enum class Schedule { InOrder, RoundRobin, Weighted, OldestFirst };
+
+char const* scheduleName(Schedule s) {
+  switch (s) {
+    case Schedule::InOrder:     return "in-order";
+    case Schedule::RoundRobin:  return "round-robin";
+    case Schedule::Weighted:    return "weighted";
+    case Schedule::OldestFirst: return "oldest-first";
+  }
+  return "?";
+}
+
+class Server {
+ public:
+  // Bytes of payload which travel inline in each line of a client slot:
+  static constexpr uint32_t inlineSize = 88;
+
+  // A request either does a unit of work (doWork), or carries a payload
+  // of argSize bytes which the server answers with a payload of the same
+  // size. An inline payload goes in args and its answer comes back in
+  // result, so it costs no extra cache lines. A larger one goes in the
+  // client's arena, which the server reads and answers in place:
+  struct alignas(128) Client {
+    static constexpr uint32_t doWork = 0;
+    static constexpr uint32_t inlinePayload = 1;
+    static constexpr uint32_t arenaPayload = 2;
+
+    std::atomic<uint32_t> inTick;  // starts as 0, an increase means that
+                                   // a new job has to be done
+    uint32_t what;    // indicates what to do, see above
+    Work* work;
+    unsigned char* arena;          // owned by the client, may be null
+    uint64_t postedAt;             // TSC when the request was posted
+    uint32_t argSize;              // payload bytes of the request
+    bool mayPark;     // client might sleep on outTick, see ParkWait
+    uint8_t qos;                   // class for Schedule::Weighted
+    alignas(8) unsigned char args[inlineSize];
+    std::atomic<uint32_t> outTick;  // starts as 0, an increase means that
+                                    // a new answer is there
+    std::atomic<uint32_t> serverGone;
+    std::atomic<uint32_t> parked;   // 1 if the client sleeps on outTick
+    uint32_t slot;                  // index in the registry
+    uint32_t resultSize;            // payload bytes of the answer
+    alignas(8) unsigned char result[inlineSize];
+    Client(Work* w, bool p = false)
+      : inTick(0), what(doWork), work(w), arena(nullptr), postedAt(0),
+        argSize(0), mayPark(p), qos(0), outTick(0), serverGone(0),
+        parked(0), slot(0), resultSize(0) { }
+  };
+  static_assert(offsetof(Client, outTick) == 128 && sizeof(Client) == 256,
+                "client slot must be one line for each direction");
+
+  // QoS classes for Schedule::Weighted, a client of class qos >= nrClasses
+  // counts as the last class:
+  static constexpr uint32_t nrClasses = 2;
+  static constexpr uint32_t qosWeights[nrClasses] = {4, 1};
+
+  // Handle for a submitted request, which is done once the server has
+  // published its tick:
+  class Future {
+    Client* cl;
+    uint32_t t;
+
+   public:
+    Future(Client* c, uint32_t tick) : cl(c), t(tick) { }
+
+    bool ready() const {
+      return cl->outTick.load(std::memory_order_acquire) == t;
+    }
+
+    void wait() const {
+      while (!ready()) {
+      }
+    }
+  };
+
+  // Publish the answer with tick t to a client and wake it up if it has
+  // gone to sleep:
+  static void publish(Client* cl, uint32_t t) {
+    publishAndWake(&cl->outTick, t, cl->mayPark, &cl->parked);
+  }
+
+  // Frees a client into the pool it came from, or from the heap:
+  struct ClientDeleter {
+    SlotPool<Client>* pool;
+    void operator()(Client* c) const {
+      if (pool != nullptr && pool->owns(c)) {
+        pool->destroy(c);
+      } else {
+        delete c;
+      }
+    }
+  };
+
+ private:
+  std::unique_ptr<SlotPool<Client>> pool;   // null for heap slots
+  ClientRegistry<Client, ClientDeleter> registry;
+  std::vector<uint32_t> ticks;    // server's copy of inTick per index
+  std::atomic<uint32_t> stop;
+  char padding2[128];             // read-mostly line for the clients follows
+
+  IdlePolicy idle;
+  ScanMode mode;
+  std::atomic<uint32_t> sleeping; // 1 while the server sleeps on it
+  char padding3[128];
+
+  // Doorbell bitmap, bit i is set when the client at index i has posted
+  // a request:
+  uint32_t nrWords;
+  std::unique_ptr<std::atomic<uint64_t>[]> pending;
+
+  // Batch mode: a pass only collects the new requests, then they are done
+  // with Work::doworkBatch and all answers are published at the end:
+  struct Request {
+    Client* cl;
+    uint32_t t;
+  };
+  bool batching;
+  std::vector<Request> batch;
+  std::atomic<uint64_t> nrBatches;   // statistics, only the server writes
+  std::atomic<uint64_t> nrBatched;
+  std::atomic<uint64_t> nrPasses;
+
+  // Weighted and OldestFirst: a pass only collects the new requests, per
+  // QoS class or all in class 0, then drain() serves them in order:
+  Schedule schedule;
+  std::vector<Request> queued[nrClasses];
+  std::vector<uint32_t> critical;    // indices of the class 0 clients
+
+  std::thread server;
+
+ public:
+  // With pooled set, newClient hands out slots from a SlotPool:
+  Server(IdlePolicy p = IdlePolicy::spin(), uint32_t capacity = 1024,
+         ScanMode m = ScanMode::Poll, bool b = false, bool pooled = false,
+         Schedule sched = Schedule::InOrder)
+    : pool(pooled ? new SlotPool<Client>(capacity) : nullptr),
+      registry(capacity, ClientDeleter{pool.get()}), ticks(capacity, 0),
+      stop(0), idle(p), mode(m), sleeping(0), nrWords((capacity + 63) / 64),
+      pending(new std::atomic<uint64_t>[nrWords]()), batching(b),
+      nrBatches(0), nrBatched(0), nrPasses(0), schedule(sched),
+      server(&Server::run, this) {
+    batch.reserve(capacity);
+  }
+
+  ~Server() {
+    stop = 1;
+    wakeUp();
+    server.join();
+  }
+
+  // A new client, from the pool if there is one and it has room, else
+  // from the heap:
+  Client* newClient(Work* w, bool mayPark = false) {
+    if (pool != nullptr) {
+      Client* c = pool->create(w, mayPark);
+      if (c != nullptr) {
+        return c;
+      }
+    }
+    return new Client(w, mayPark);
+  }
+
+  // Whether the pool lies on explicit huge pages:
+  bool hugePages() const {
+    return pool != nullptr && pool->hugePages();
+  }
+
+  // Publishes c to the server, returns false if there is no room for it:
+  bool registerClient(Client* c) {
+    c->slot = registry.add(c);
+    wakeIfSleeping();
+    return c->slot != ~0u;
+  }
+
+  // Withdraws c, which must not have a request outstanding. The server
+  // deletes it once its current pass is over, a sleeping server is woken
+  // for that:
+  void unregisterClient(Client* c) {
+    registry.remove(c->slot);
+    wakeIfSleeping();
+  }
+
+  // Submit the next request of a client, which must not have another one
+  // outstanding, without waiting for it:
+  Future submit(Client* cl) {
+    uint32_t t = cl->inTick.load(std::memory_order_relaxed) + 1;
+    cl->postedAt = __rdtsc();
+    cl->inTick.store(t, std::memory_order_release);
+    notify(cl);
+    return Future(cl, t);
+  }
+
+  // A client calls this after increasing its inTick, to ring its doorbell
+  // and to wake the server if its idle policy allows it to sleep:
+  void notify(Client* cl) {
+    if (mode == ScanMode::Doorbell) {
+      pending[cl->slot >> 6].fetch_or(1ULL << (cl->slot & 63),
+                                      std::memory_order_release);
+    }
+    wakeIfSleeping();
+  }
+
+  // Pin the server thread to a CPU, -1 leaves it to the OS:
+  void pin(int cpu) {
+    pinThread(server.native_handle(), cpu);
+  }
+
+  // Number of batches and of requests done in them so far:
+  uint64_t batches() const {
+    return nrBatches.load(std::memory_order_relaxed);
+  }
+
+  uint64_t batched() const {
+    return nrBatched.load(std::memory_order_relaxed);
+  }
+
+  // Number of passes over the clients so far:
+  uint64_t passes() const {
+    return nrPasses.load(std::memory_order_relaxed);
+  }
+
+  // CPU time the server thread has used so far, in seconds:
+  double cpuTime() {
+    return threadCpuTime(server);
+  }
+
+ private:
+  void wakeUp() {
+    if (sleeping.exchange(0) != 0) {
+      futexWake(&sleeping, 1);
+    }
+  }
+
+  // Wake the server after a change it has to see, if its idle policy lets
+  // it sleep. The fence orders the change before our load of sleeping, and
+  // backOff stores sleeping before it looks again, so one of us sees the
+  // other:
+  void wakeIfSleeping() {
+    if (idle.sleep) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (sleeping.load(std::memory_order_relaxed) != 0) {
+        wakeUp();
+      }
+    }
+  }
+
+  bool anythingToDo() {
+    uint32_t s = registry.size();
+    for (uint32_t i = 0; i < s; ++i) {
+      Client* cl = registry.get(i);
+      if (cl != nullptr &&
+          cl->inTick.load(std::memory_order_relaxed) != ticks[i]) {
+        return true;
+      }
+    }
+    return registry.hasRetired() || stop.load(std::memory_order_relaxed) > 0;
+  }
+
+  // Called after the idlePasses-th pass in a row which found nothing to do:
+  void backOff(uint32_t idlePasses) {
+    if (idlePasses < idle.spinPasses) {
+      return;
+    }
+    idlePasses -= idle.spinPasses;
+    if (idlePasses < idle.pausePasses) {
+      uint32_t delay = idlePasses < 16 ? 1u << idlePasses : idle.maxPause;
+      if (delay > idle.maxPause) {
+        delay = idle.maxPause;
+      }
+      for (uint32_t i = 0; i < delay; ++i) {
+        _mm_pause();
+      }
+      return;
+    }
+    if (idle.sleep) {
+      // Announce the sleep first and look again, a client which has posted
+      // a request or (un)registered in between will see sleeping and wake
+      // us. The fence pairs with the one in wakeIfSleeping:
+      sleeping.store(1, std::memory_order_seq_cst);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!anythingToDo()) {
+        futexWait(&sleeping, 1);
+      }
+      sleeping.store(0, std::memory_order_relaxed);
+    }
+  }
+
+ public:
+  // Answer the payload request of cl: every byte increased by one, read
+  // and written inline or in place in the arena:
+  static void answerPayload(Client* cl) {
+    bool inlined = cl->what == Client::inlinePayload;
+    unsigned char const* in = inlined ? cl->args : cl->arena;
+    unsigned char* out = inlined ? cl->result : cl->arena;
+    uint32_t n = cl->argSize;
+    for (uint32_t k = 0; k < n; ++k) {
+      out[k] = in[k] + 1;
+    }
+    cl->resultSize = n;
+  }
+
+  // Do the request of cl with tick t and publish the answer:
+  static void answer(Client* cl, uint32_t t) {
+    if (cl->what != Client::doWork) {
+      answerPayload(cl);
+    } else {
+      cl->work->dowork();
+    }
+    publish(cl, t);
+  }
+
+  // Serve the client cl at index i if it has a new request, in batch mode
+  // or with an ordering schedule only collect it. Payload requests are not
+  // batched:
+  bool serve(uint32_t i, Client* cl) {
+    uint32_t t = cl->inTick.load(std::memory_order_acquire);
+    if (t == ticks[i]) {
+      return false;
+    }
+    ticks[i] = t;
+    if (batching) {
+      if (cl->what == Client::doWork) {
+        batch.push_back(Request{cl, t});
+      } else {
+        answer(cl, t);
+      }
+      return true;
+    }
+    if (schedule == Schedule::Weighted) {
+      queued[cl->qos < nrClasses ? cl->qos : nrClasses - 1].push_back(
+        Request{cl, t});
+      return true;
+    }
+    if (schedule == Schedule::OldestFirst) {
+      queued[0].push_back(Request{cl, t});
+      return true;
+    }
+    answer(cl, t);
+    return true;
+  }
+
+  bool anyQueued() const {
+    for (std::vector<Request> const& q : queued) {
+      if (!q.empty()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Serve the requests collected in this pass according to the schedule:
+  void drain() {
+    if (schedule == Schedule::OldestFirst) {
+      std::sort(queued[0].begin(), queued[0].end(),
+                [](Request const& a, Request const& b) {
+                  return a.cl->postedAt < b.cl->postedAt;
+                });
+      for (Request const& r : queued[0]) {
+        answer(r.cl, r.t);
+      }
+      queued[0].clear();
+      return;
+    }
+    // Weighted: while requests of the other classes from this pass are
+    // pending, look for new requests of the class 0 clients after every
+    // round, so none of them waits for more than one round of the others.
+    // Every round serves at least one of those, so the pass ends and the
+    // next scan collects the requests posted meanwhile:
+    size_t next[nrClasses] = {};
+    bool more = true;
+    while (more) {
+      bool othersPending = false;
+      for (uint32_t k = 0; k < nrClasses; ++k) {
+        std::vector<Request>& q = queued[k];
+        for (uint32_t n = 0; n < qosWeights[k] && next[k] < q.size(); ++n) {
+          answer(q[next[k]].cl, q[next[k]].t);
+          ++next[k];
+        }
+        othersPending = othersPending || (k > 0 && next[k] < q.size());
+      }
+      if (othersPending) {
+        for (uint32_t i : critical) {
+          Client* cl = registry.get(i);
+          if (cl != nullptr) {
+            serve(i, cl);
+          }
+        }
+      }
+      more = othersPending || next[0] < queued[0].size();
+    }
+    for (std::vector<Request>& q : queued) {
+      q.clear();
+    }
+  }
+
+  // Do the collected requests, runs of requests on the same Work go into
+  // one batch kernel, then publish all answers:
+  void flush() {
+    size_t n = batch.size();
+    size_t start = 0;
+    while (start < n) {
+      Work* w = batch[start].cl->work;
+      size_t end = start + 1;
+      while (end < n && batch[end].cl->work == w) {
+        ++end;
+      }
+      w->doworkBatch(end - start);
+      start = end;
+    }
+    for (Request const& r : batch) {
+      publish(r.cl, r.t);
+    }
+    batch.clear();
+    nrBatches.store(nrBatches.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+    nrBatched.store(nrBatched.load(std::memory_order_relaxed) + n,
+                    std::memory_order_relaxed);
+  }
+
+  void run() {
+    uint32_t idlePasses = 0;
+    while (true) {
+      registry.reclaim([this](uint32_t i) { ticks[i] = 0; });
+
+      // Usual work:
+      bool busy = false;
+      uint32_t s = registry.size();
+      if (mode == ScanMode::Poll) {
+        uint32_t start = 0;
+        if (schedule == Schedule::RoundRobin && s > 0) {
+          start = static_cast<uint32_t>(
+            nrPasses.load(std::memory_order_relaxed) % s);
+        }
+        critical.clear();
+        for (uint32_t k = 0; k < s; ++k) {
+          uint32_t i = start + k < s ? start + k : start + k - s;
+          uint32_t n = i + 1 < s ? i + 1 : 0;
+          Client* cl = registry.get(i);
+          if (k + 1 < s) {
+            _mm_prefetch(registry.get(n), _mm_hint::_MM_HINT_T0);
+          }
+          if (cl == nullptr) {
+            continue;
+          }
+          if (schedule == Schedule::Weighted && cl->qos == 0) {
+            critical.push_back(i);
+          }
+          if (serve(i, cl)) {
+            busy = true;
+          }
+        }
+      } else {
+        uint32_t words = (s + 63) / 64;
+        for (uint32_t w = 0; w < words; ++w) {
+          if (pending[w].load(std::memory_order_relaxed) == 0) {
+            continue;
+          }
+          uint64_t bits = pending[w].exchange(0, std::memory_order_acquire);
+          while (bits != 0) {
+            uint32_t i = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            Client* cl = registry.get(i);
+            if (cl != nullptr && serve(i, cl)) {
+              busy = true;
+            }
+          }
+        }
+      }
+      if (!batch.empty()) {
+        flush();
+      }
+      if (anyQueued()) {
+        drain();
+      }
+      nrPasses.store(nrPasses.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+      if (busy) {
+        idlePasses = 0;
+      } else if (idlePasses < ~0u) {
+        backOff(idlePasses++);
+      }
+
+      // Stop?
+      if (stop.load(std::memory_order_relaxed) > 0) {
+        for (uint32_t i = 0; i < s; ++i) {
+          Client* cl = registry.get(i);
+          if (cl != nullptr) {
+            cl->serverGone = 1;
+          }
+        }
+        break;
+      }
+    }
+  }
+};
+
+size_t parkSpins = 0;     // number of pause iterations a parking client
+                          // spins before it goes to sleep, will be gauged
+                          // at beginning of program
+
+// Wait strategies for a client which waits until the server has stored
+// value into word. They work for every server protocol, parked is the
+// client's flag for publishAndWake:
+
+// Pure busy waiting, burns a full core per waiting client:
+struct SpinWait {
+  static constexpr bool mayPark = false;
+  static void wait(std::atomic<uint32_t>* word, uint32_t value,
+                   std::atomic<uint32_t>*) {
+    while (word->load(std::memory_order_acquire) != value) {
+    }
+  }
+};
+
+// Busy waiting, but give the core to others between polls:
+struct YieldWait {
+  static constexpr bool mayPark = false;
+  static void wait(std::atomic<uint32_t>* word, uint32_t value,
+                   std::atomic<uint32_t>*) {
+    while (word->load(std::memory_order_acquire) != value) {
+      std::this_thread::yield();
+    }
+  }
+};
+
+// Spin for parkSpins pause iterations, which costs about as much as going
+// to sleep and being woken up, then sleep on a futex until the server
+// publishes the answer:
+struct ParkWait {
+  static constexpr bool mayPark = true;
+  static void wait(std::atomic<uint32_t>* word, uint32_t value,
+                   std::atomic<uint32_t>* parked) {
+    for (size_t i = 0; i < parkSpins; ++i) {
+      if (word->load(std::memory_order_acquire) == value) {
+        return;
+      }
+      _mm_pause();
+    }
+    while (true) {
+      parked->store(1, std::memory_order_seq_cst);
+      uint32_t o = word->load(std::memory_order_seq_cst);
+      if (o == value) {
+        parked->store(0, std::memory_order_relaxed);
+        return;
+      }
+      futexWait(word, o);
+    }
+  }
+};
+
+// Gauge how long it takes to hand over between two threads via a futex,
+// and set parkSpins to the number of pause iterations taking as long.
+// Returns the handover time in ns:
+double calibrateParking() {
+  std::chrono::high_resolution_clock clock;
+  size_t const pauses = 1000000;
+  auto startTime = clock.now();
+  for (size_t i = 0; i < pauses; ++i) {
+    _mm_pause();
+  }
+  std::chrono::duration<double> pauseTime = clock.now() - startTime;
+
+  uint32_t const rounds = 10000;
+  std::atomic<uint32_t> flag(0);
+  std::thread partner([&flag, rounds]() {
+    for (uint32_t i = 0; i < rounds; ++i) {
+      uint32_t f;
+      while ((f = flag.load()) != 2 * i + 1) {
+        futexWait(&flag, f);
+      }
+      flag.store(2 * i + 2);
+      futexWake(&flag, 1);
+    }
+  });
+  startTime = clock.now();
+  for (uint32_t i = 0; i < rounds; ++i) {
+    flag.store(2 * i + 1);
+    futexWake(&flag, 1);
+    uint32_t f;
+    while ((f = flag.load()) != 2 * i + 2) {
+      futexWait(&flag, f);
+    }
+  }
+  std::chrono::duration<double> handoverTime = clock.now() - startTime;
+  partner.join();
+
+  double pauseNs = pauseTime.count() / pauses * 1e9;
+  double handoverNs = handoverTime.count() / (2 * rounds) * 1e9;
+  parkSpins = static_cast<size_t>(handoverNs / pauseNs);
+  if (parkSpins < 1) {
+    parkSpins = 1;
+  }
+  return handoverNs;
+}
+
+template <typename Wait, typename S = Server>
+void clientThread(S* server, Work* work, std::atomic<int>* stop,
+                  uint64_t* count, Histogram* hist, uint8_t qos = 0) {
+  Server::Client* cl = server->newClient(work, Wait::mayPark);
+  cl->qos = qos;
+  server->registerClient(cl);
+  // simply work as client until stop is signalled:
+  uint64_t c = 0;
+  Histogram h;
+  uint64_t last = __rdtsc();
+  size_t perRound = ceill(1e-5 / workTime);
+  uint32_t t = 0;
+  while (stop->load(std::memory_order_relaxed) == 0) {
+    for (size_t i = 0; i < perRound; ++i) {
+      cl->postedAt = __rdtsc();
+      cl->inTick.store(++t, std::memory_order_release);
+      server->notify(cl);
+      Wait::wait(&cl->outTick, t, &cl->parked);
+      ++c;
+      last = h.recordSince(last);
+    }
+  }
+  server->unregisterClient(cl);
+  *count = c;
+  *hist = h;
+}
+
+// Client which sends requests with a payload of size bytes and reads the
+// whole answer. The payload goes inline if it fits and useArena is not
+// set, else in an arena of the client:
+void payloadClientThread(Server* server, uint32_t size, bool useArena,
+                         std::atomic<int>* stop, uint64_t* count,
+                         Histogram* hist) {
+  Server::Client* cl = new Server::Client(nullptr);
+  bool inlined = !useArena && size <= Server::inlineSize;
+  size_t arenaSize = (size + 127) / 128 * 128;
+  unsigned char* arena = nullptr;
+  if (!inlined) {
+    arena = static_cast<unsigned char*>(std::aligned_alloc(128, arenaSize));
+  }
+  cl->arena = arena;
+  cl->what = inlined ? Server::Client::inlinePayload
+                     : Server::Client::arenaPayload;
+  cl->argSize = size;
+  server->registerClient(cl);
+  unsigned char* request = inlined ? cl->args : arena;
+  unsigned char const* answer = inlined ? cl->result : arena;
+  uint64_t c = 0;
+  uint64_t sum = 0;
+  Histogram h;
+  uint64_t last = __rdtsc();
+  size_t perRound = ceill(1e-5 / workTime);
+  uint32_t t = 0;
+  while (stop->load(std::memory_order_relaxed) == 0) {
+    for (size_t i = 0; i < perRound; ++i) {
+      memset(request, static_cast<int>(c), size);
+      cl->postedAt = __rdtsc();
+      cl->inTick.store(++t, std::memory_order_release);
+      server->notify(cl);
+      SpinWait::wait(&cl->outTick, t, &cl->parked);
+      for (uint32_t k = 0; k < size; ++k) {
+        sum += answer[k];
+      }
+      ++c;
+      last = h.recordSince(last);
+    }
+  }
+  // The server never looks at the arena again once the last answer is
+  // there, so it can go before the client does:
+  server->unregisterClient(cl);
+  free(arena);
+  resultSink.fetch_add(sum, std::memory_order_relaxed);
+  *count = c;
+  *hist = h;
+}
+
+// Delegation with the protocol of the original servertest1: a client has
+// a single word what, which is 0 when there is nothing to do. The client
+// sets it to a positive job id (1 means unregister, 2 means do a unit of
+// work) and the server sets it to the negative of the id once the job is
+// done. The clients live in a fixed array of at most maxNrClients, which
+// is changed under a mutex and compacted when a client leaves.
+class WhatServer {
+ public:
+  struct alignas(128) Client {
+    std::atomic<uint32_t> what;    // holds the signed job id
+    std::atomic<uint32_t> parked;  // 1 if the client sleeps on what
+    bool mayPark;                  // client might sleep, see ParkWait
+    Work* work;
+    Client(Work* w, bool p = false)
+      : what(0), parked(0), mayPark(p), work(w) { }
+  };
+
+  // Value of what once job is done:
+  static uint32_t done(uint32_t job) {
+    return static_cast<uint32_t>(-static_cast<int32_t>(job));
+  }
+
+ private:
+  std::mutex mutex;
+  size_t maxNrClients;
+  std::unique_ptr<Client*[]> clients;
+  std::atomic<size_t> nrClients;
+  std::atomic<uint32_t> stop;
+  std::thread server;
+
+ public:
+  WhatServer(size_t m)
+    : maxNrClients(m), clients(new Client*[m]), nrClients(0), stop(0),
+      server(&WhatServer::run, this) {
+  }
+
+  ~WhatServer() {
+    if (nrClients > 0) {
+      std::cerr << "Warning: Server has clients on destruction!" << std::endl;
+    }
+    stop = 1;
+    server.join();
+  }
+
+  bool registerClient(Client* c) {
+    std::unique_lock<std::mutex> guard(mutex);
+    if (nrClients >= maxNrClients) {
+      return false;
+    }
+    clients[nrClients] = c;
+    ++nrClients;
+    return true;
+  }
+
+  // Have the server do job for c and wait for it with strategy Wait:
+  template <typename Wait>
+  void execute(Client* c, uint32_t job) {
+    c->what.store(job, std::memory_order_release);
+    Wait::wait(&c->what, done(job), &c->parked);
+  }
+
+  // Leave the server, afterwards c belongs to the caller again. The
+  // client spins here, since the server must not touch c after its answer:
+  void unregisterClient(Client* c) {
+    execute<SpinWait>(c, 1);
+  }
+
+ private:
+  void removeClient(size_t pos) {
+    std::unique_lock<std::mutex> guard(mutex);
+    clients[pos] = clients[nrClients - 1];
+    --nrClients;
+  }
+
+  void run() {
+    while (stop.load(std::memory_order_relaxed) == 0) {
+      size_t nr = nrClients.load(std::memory_order_acquire);
+      size_t i = 0;
+      while (i < nr) {
+        Client* cl = clients[i];
+        uint32_t what = cl->what.load(std::memory_order_acquire);
+        if (static_cast<int32_t>(what) <= 0) {
+          ++i;
+          continue;
+        }
+        if (what == 1) {
+          // The last client moves to position i, so look at i again:
+          removeClient(i);
+          --nr;
+          cl->what.store(done(what), std::memory_order_release);
+          continue;
+        }
+        if (what == 2) {
+          cl->work->dowork();
+        }
+        publishAndWake(&cl->what, done(what), cl->mayPark, &cl->parked);
+        ++i;
+      }
+    }
+  }
+};
+
+template <typename Wait>
+void whatClientThread(WhatServer* server, Work* work, std::atomic<int>* stop,
+                      uint64_t* count, Histogram* hist) {
+  WhatServer::Client* cl = new WhatServer::Client(work, Wait::mayPark);
+  server->registerClient(cl);
+  // simply work as client until stop is signalled:
+  uint64_t c = 0;
+  Histogram h;
+  uint64_t last = __rdtsc();
+  size_t perRound = ceill(1e-5 / workTime);
+  while (stop->load(std::memory_order_relaxed) == 0) {
+    for (size_t i = 0; i < perRound; ++i) {
+      server->execute<Wait>(cl, 2);
+      ++c;
+      last = h.recordSince(last);
+    }
+  }
+  server->unregisterClient(cl);
+  delete cl;
+  *count = c;
+  *hist = h;
+}
+
+// Delegation through one intrusive lock-free MPSC queue (Vyukov's): a
+// client pushes its request node with a single exchange on the head, the
+// server pops nodes off the tail, does the work and sets done in the
+// node. The server never looks at idle clients, so its cost depends only
+// on the pending requests and not on the number of clients.
+class QueueServer {
+ public:
+  struct alignas(128) Node {
+    std::atomic<Node*> next;
+    Work* work;
+    std::atomic<uint32_t> done;   // set to 1 by the server
+    Node(Work* w) : next(nullptr), work(w), done(0) { }
+  };
+
+ private:
+  alignas(128) std::atomic<Node*> head;   // the clients push here
+  alignas(128) Node* tail;                // only the server touches it
+  Node stub;                              // keeps the queue non-empty
+  std::atomic<uint32_t> stop;
+  std::thread server;
+
+ public:
+  QueueServer()
+    : head(&stub), tail(&stub), stub(nullptr), stop(0),
+      server(&QueueServer::run, this) { }
+
+  ~QueueServer() {
+    stop = 1;
+    server.join();
+  }
+
+  // Enqueue the request n, which the client may reuse once done is set:
+  void push(Node* n) {
+    n->next.store(nullptr, std::memory_order_relaxed);
+    Node* prev = head.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+  }
+
+  // Post the request n and wait until it is done:
+  void execute(Node* n) {
+    n->done.store(0, std::memory_order_relaxed);
+    push(n);
+    SpinWait::wait(&n->done, 1, nullptr);
+  }
+
+ private:
+  // Dequeue the oldest request, nullptr if there is none or if the next
+  // one is not completely linked in yet:
+  Node* pop() {
+    Node* t = tail;
+    Node* next = t->next.load(std::memory_order_acquire);
+    if (t == &stub) {
+      if (next == nullptr) {
+        return nullptr;
+      }
+      tail = next;
+      t = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != nullptr) {
+      tail = next;
+      return t;
+    }
+    if (t != head.load(std::memory_order_acquire)) {
+      return nullptr;   // a push is between its exchange and its link
+    }
+    // t is the last node, put the stub behind it so that t can go:
+    push(&stub);
+    next = t->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+      tail = next;
+      return t;
+    }
+    return nullptr;
+  }
+
+  void run() {
+    while (stop.load(std::memory_order_relaxed) == 0) {
+      Node* n;
+      while ((n = pop()) != nullptr) {
+        n->work->dowork();
+        n->done.store(1, std::memory_order_release);
+      }
+    }
+  }
+};
+
+void queueClientThread(QueueServer* server, Work* work,
+                       std::atomic<int>* stop, uint64_t* count,
+                       Histogram* hist) {
+  QueueServer::Node* node = new QueueServer::Node(work);
+  // simply work as client until stop is signalled:
+  uint64_t c = 0;
+  Histogram h;
+  uint64_t last = __rdtsc();
+  size_t perRound = ceill(1e-5 / workTime);
+  while (stop->load(std::memory_order_relaxed) == 0) {
+    for (size_t i = 0; i < perRound; ++i) {
+      server->execute(node);
+      ++c;
+      last = h.recordSince(last);
+    }
+  }
+  delete node;
+  *count = c;
+  *hist = h;
+}
+
+// Slot layouts for LayoutServer. Each gives the request tick in(i), the
+// answer tick out(i) and the Work work(i) of the client at index i, and
+// changed(first, n, known), a mask of which of the n <= 32 clients from
+// first on have a request tick other than known (bits from n on may be
+// set too). Capacities are rounded up to 32:
+
+// Mask for the scalar layouts:
+template <typename Slots>
+uint32_t changedScalar(Slots& slots, uint32_t first, uint32_t n,
+                       uint32_t const* known) {
+  uint32_t mask = 0;
+  for (uint32_t k = 0; k < n; ++k) {
+    if (slots.in(first + k).load(std::memory_order_relaxed) != known[k]) {
+      mask |= 1u << k;
+    }
+  }
+  return mask;
+}
+
+// Array of structures with inTick and outTick on lines of their own, as in
+// Server::Client. There is no false sharing, but a scan touches one line
+// per client:
+class PaddedSlots {
+  struct alignas(128) Slot {
+    std::atomic<uint32_t> inTick{0};
+    Work* work{nullptr};
+    alignas(128) std::atomic<uint32_t> outTick{0};
+  };
+  std::unique_ptr<Slot[]> slots;
+
+ public:
+  static constexpr char const* name = "padded";
+
+  explicit PaddedSlots(uint32_t capacity)
+    : slots(new Slot[(capacity + 31) / 32 * 32]) { }
+
+  std::atomic<uint32_t>& in(uint32_t i) { return slots[i].inTick; }
+  std::atomic<uint32_t>& out(uint32_t i) { return slots[i].outTick; }
+  Work*& work(uint32_t i) { return slots[i].work; }
+  uint32_t changed(uint32_t first, uint32_t n, uint32_t const* known) {
+    return changedScalar(*this, first, n, known);
+  }
+};
+
+// Array of structures without padding, as in the original servertest1:
+// eight clients share a line, and each of them writes it, as does the
+// server for their answers:
+class PackedSlots {
+  struct Slot {
+    std::atomic<uint32_t> inTick{0};
+    std::atomic<uint32_t> outTick{0};
+    Work* work{nullptr};
+  };
+  std::unique_ptr<Slot[]> slots;
+
+ public:
+  static constexpr char const* name = "packed";
+
+  explicit PackedSlots(uint32_t capacity)
+    : slots(new Slot[(capacity + 31) / 32 * 32]) { }
+
+  std::atomic<uint32_t>& in(uint32_t i) { return slots[i].inTick; }
+  std::atomic<uint32_t>& out(uint32_t i) { return slots[i].outTick; }
+  Work*& work(uint32_t i) { return slots[i].work; }
+  uint32_t changed(uint32_t first, uint32_t n, uint32_t const* known) {
+    return changedScalar(*this, first, n, known);
+  }
+};
+
+// Structure of arrays: the request ticks, which the server scans, in one
+// array, the answer ticks in another, 32 clients per line. A scan reads
+// few lines and compares a line at once, but the clients sharing a line
+// write it concurrently:
+class SplitSlots {
+  struct alignas(128) TickLine {
+    std::atomic<uint32_t> ticks[32]{};
+  };
+  std::unique_ptr<TickLine[]> inTicks;
+  std::unique_ptr<TickLine[]> outTicks;
+  std::unique_ptr<Work*[]> works;
+
+ public:
+  static constexpr char const* name = "split";
+
+  explicit SplitSlots(uint32_t capacity)
+    : inTicks(new TickLine[(capacity + 31) / 32]),
+      outTicks(new TickLine[(capacity + 31) / 32]),
+      works(new Work*[(capacity + 31) / 32 * 32]()) { }
+
+  std::atomic<uint32_t>& in(uint32_t i) {
+    return inTicks[i / 32].ticks[i % 32];
+  }
+  std::atomic<uint32_t>& out(uint32_t i) {
+    return outTicks[i / 32].ticks[i % 32];
+  }
+  Work*& work(uint32_t i) { return works[i]; }
+  uint32_t changed(uint32_t first, [[maybe_unused]] uint32_t n,
+                   uint32_t const* known) {
+#if defined(__AVX2__)
+    // The vector loads read the atomic ticks without atomics, which is a
+    // deliberate data race: a torn tick only makes the server look at the
+    // client with an acquire load, and a stale one only delays the client
+    // to the next scan:
+    auto line = reinterpret_cast<__m256i const*>(inTicks[first / 32].ticks);
+    auto mine = reinterpret_cast<__m256i const*>(known);
+    uint32_t mask = 0;
+    for (uint32_t k = 0; k < 4; ++k) {
+      __m256i eq = _mm256_cmpeq_epi32(_mm256_load_si256(line + k),
+                                      _mm256_loadu_si256(mine + k));
+      mask |= static_cast<uint32_t>(
+        _mm256_movemask_ps(_mm256_castsi256_ps(eq))) << (8 * k);
+    }
+    return ~mask;
+#else
+    return changedScalar(*this, first, n, known);
+#endif
+  }
+};
+
+// Tick protocol server with the client slots laid out by Slots (one of
+// the classes above), to compare the layouts. It is a microbenchmark only
+// and leaves out what Server has besides the scan (idle policies,
+// doorbells, batching, schedules, payloads); Server keeps its padded
+// layout. The server scans 32 clients at a time. Clients only register,
+// their indices are not reused:
+template <typename Slots>
+class LayoutServer {
+  Slots slots;
+  uint32_t capacity;
+  std::unique_ptr<uint32_t[]> ticks;   // server's copy of in(i)
+  alignas(128) std::atomic<uint32_t> used;
+  std::atomic<uint32_t> stop;
+  std::atomic<uint64_t> nrPasses;      // statistics, only the server writes
+  std::thread server;
+
+ public:
+  explicit LayoutServer(uint32_t cap)
+    : slots(cap), capacity(cap),
+      ticks(new uint32_t[(cap + 31) / 32 * 32]()), used(0),
+      stop(0), nrPasses(0), server(&LayoutServer::run, this) { }
+
+  ~LayoutServer() {
+    stop = 1;
+    server.join();
+  }
+
+  // Returns the index of a new client working on w, ~0u if there is no
+  // room. The server does not look at its work before its first request:
+  uint32_t registerClient(Work* w) {
+    uint32_t i = used.load(std::memory_order_relaxed);
+    do {
+      if (i >= capacity) {
+        return ~0u;
+      }
+    } while (!used.compare_exchange_weak(i, i + 1,
+                                         std::memory_order_relaxed));
+    slots.work(i) = w;
+    return i;
+  }
+
+  // Post a request of client i and wait for the answer:
+  void execute(uint32_t i) {
+    uint32_t t = slots.in(i).load(std::memory_order_relaxed) + 1;
+    slots.in(i).store(t, std::memory_order_release);
+    SpinWait::wait(&slots.out(i), t, nullptr);
+  }
+
+  // Number of passes over the clients so far:
+  uint64_t passes() const {
+    return nrPasses.load(std::memory_order_relaxed);
+  }
+
+  // CPU time the server thread has used so far, in seconds:
+  double cpuTime() {
+    return threadCpuTime(server);
+  }
+
+ private:
+  void run() {
+    while (stop.load(std::memory_order_relaxed) == 0) {
+      uint32_t s = used.load(std::memory_order_acquire);
+      for (uint32_t first = 0; first < s; first += 32) {
+        uint32_t mask = slots.changed(first, std::min(s - first, 32u),
+                                      &ticks[first]);
+        while (mask != 0) {
+          uint32_t i = first + __builtin_ctz(mask);
+          mask &= mask - 1;
+          uint32_t t = slots.in(i).load(std::memory_order_acquire);
+          if (i < s && t != ticks[i]) {
+            ticks[i] = t;
+            slots.work(i)->dowork();
+            slots.out(i).store(t, std::memory_order_release);
+          }
+        }
+      }
+      nrPasses.store(nrPasses.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+    }
+  }
+};
+
+template <typename Slots>
+void layoutClientThread(LayoutServer<Slots>* server, Work* work,
+                        std::atomic<int>* stop, uint64_t* count,
+                        Histogram* hist) {
+  uint32_t i = server->registerClient(work);
+  // simply work as client until stop is signalled:
+  uint64_t c = 0;
+  Histogram h;
+  uint64_t last = __rdtsc();
+  size_t perRound = ceill(1e-5 / workTime);
+  while (stop->load(std::memory_order_relaxed) == 0) {
+    for (size_t k = 0; k < perRound; ++k) {
+      server->execute(i);
+      ++c;
+      last = h.recordSince(last);
+    }
+  }
+  *count = c;
+  *hist = h;
+}
+
+// Elastic delegation: a pool of up to maxServers server threads, of which
+// the first nrActive serve the clients, server k the indices i with
+// i % nrActive == k. Server 0 leads: it watches which fraction of the
+// passes of the active servers finds pending work, and after sustain
+// windows in a row above highWater (below lowWater) it activates (retires)
+// one server. Retired servers sleep on a futex.
+//
+// A reconfiguration bumps generation, every server acknowledges it at the
+// end of its pass and waits, and only then the leader changes nrActive
+// and releases them. So no index is ever served by two servers, and a
+// request which is in flight during the change is found by the new owner
+// of its index, since the server copies of the ticks are shared. While
+// everybody waits, the leader also reclaims unregistered clients.
+//
+// The work of clients in different partitions is done concurrently, so
+// they must not share a Work.
+class ElasticServer {
+ public:
+  typedef Server::Client Client;
+
+  // A change of the number of active servers:
+  struct Change {
+    uint64_t tsc;
+    uint32_t servers;
+  };
+
+ private:
+  static constexpr double highWater = 0.75;
+  static constexpr double lowWater = 0.25;
+  static constexpr uint32_t sustain = 3;
+  static constexpr uint32_t maxChanges = 4096;
+
+  struct alignas(128) PerServer {
+    std::atomic<uint32_t> ack;          // last generation acknowledged
+    std::atomic<uint64_t> passes;       // only the server itself writes
+    std::atomic<uint64_t> busyPasses;   // these two
+    PerServer() : ack(0), passes(0), busyPasses(0) { }
+  };
+
+  ClientRegistry<Client> registry;
+  std::unique_ptr<uint32_t[]> ticks;   // server's copy of inTick per index
+  uint32_t maxServers;
+  std::unique_ptr<PerServer[]> perServer;
+  alignas(128) std::atomic<uint32_t> generation;
+  std::atomic<uint32_t> released;      // generation which is in force
+  std::atomic<uint32_t> nrActive;
+  std::atomic<uint32_t> stop;
+  std::unique_ptr<Change[]> changes;   // log, only the leader appends
+  std::atomic<uint32_t> nrChanges;
+  uint64_t windowTicks;                // length of a load window
+  std::vector<std::thread> servers;
+
+ public:
+  ElasticServer(uint32_t capacity, uint32_t m)
+    : registry(capacity), ticks(new uint32_t[capacity]()), maxServers(m),
+      perServer(new PerServer[m]), generation(0), released(0), nrActive(1),
+      stop(0), changes(new Change[maxChanges]), nrChanges(0),
+      windowTicks(static_cast<uint64_t>(tscPerNs * 1e6)) {
+    for (uint32_t k = 0; k < maxServers; ++k) {
+      servers.emplace_back(&ElasticServer::run, this, k);
+    }
+  }
+
+  ~ElasticServer() {
+    stop = 1;
+    generation.fetch_add(1);   // so that no server goes to sleep again
+    futexWake(&generation, INT32_MAX);
+    for (std::thread& t : servers) {
+      t.join();
+    }
+  }
+
+  Client* newClient(Work* w, bool mayPark = false) {
+    return new Client(w, mayPark);
+  }
+
+  // Publishes c to the servers, returns false if there is no room for it:
+  bool registerClient(Client* c) {
+    c->slot = registry.add(c);
+    return c->slot != ~0u;
+  }
+
+  // Withdraws c, which must not have a request outstanding. The leader
+  // deletes it at the next reconfiguration:
+  void unregisterClient(Client* c) {
+    registry.remove(c->slot);
+  }
+
+  // The servers always poll, there is nobody to notify:
+  void notify(Client*) {
+  }
+
+  uint32_t activeServers() const {
+    return nrActive.load(std::memory_order_relaxed);
+  }
+
+  // Changes logged so far, entries below changeCount() are valid:
+  uint32_t changeCount() const {
+    return nrChanges.load(std::memory_order_acquire);
+  }
+
+  Change change(uint32_t i) const {
+    return changes[i];
+  }
+
+ private:
+  // Only for the leader: stop all servers after their pass, then make n
+  // of them active and reclaim the unregistered clients:
+  void reconfigure(uint32_t n) {
+    uint32_t g = generation.load(std::memory_order_relaxed) + 1;
+    generation.store(g, std::memory_order_seq_cst);
+    futexWake(&generation, INT32_MAX);
+    for (uint32_t k = 1; k < maxServers; ++k) {
+      while (perServer[k].ack.load(std::memory_order_acquire) != g) {
+        if (stop.load(std::memory_order_relaxed) > 0) {
+          return;
+        }
+        _mm_pause();
+      }
+    }
+    registry.reclaim([this](uint32_t i) { ticks[i] = 0; });
+    if (n != nrActive.load(std::memory_order_relaxed)) {
+      nrActive.store(n, std::memory_order_relaxed);
+      uint32_t c = nrChanges.load(std::memory_order_relaxed);
+      if (c < maxChanges) {
+        changes[c] = Change{__rdtsc(), n};
+        nrChanges.store(c + 1, std::memory_order_release);
+      }
+    }
+    perServer[0].ack.store(g, std::memory_order_relaxed);
+    released.store(g, std::memory_order_release);
+  }
+
+  void run(uint32_t k) {
+    PerServer& me = perServer[k];
+    uint32_t seen = 0;
+    // Only used by the leader:
+    uint64_t windowStart = __rdtsc();
+    std::vector<uint64_t> lastPasses(maxServers, 0);
+    std::vector<uint64_t> lastBusy(maxServers, 0);
+    uint32_t hot = 0;
+    uint32_t cold = 0;
+
+    while (stop.load(std::memory_order_relaxed) == 0) {
+      // Reconfiguration?
+      uint32_t g = generation.load(std::memory_order_acquire);
+      if (g != seen) {
+        me.ack.store(g, std::memory_order_release);
+        while (released.load(std::memory_order_acquire) != g &&
+               stop.load(std::memory_order_relaxed) == 0) {
+          _mm_pause();
+        }
+        seen = g;
+        continue;
+      }
+      uint32_t n = nrActive.load(std::memory_order_relaxed);
+      if (k >= n) {
+        futexWait(&generation, seen);
+        continue;
+      }
+
+      // Usual work on our partition:
+      bool busy = false;
+      uint32_t s = registry.size();
+      for (uint32_t i = k; i < s; i += n) {
+        Client* cl = registry.get(i);
+        if (cl == nullptr) {
+          continue;
+        }
+        uint32_t t = cl->inTick.load(std::memory_order_acquire);
+        if (t != ticks[i]) {
+          ticks[i] = t;
+          cl->work->dowork();
+          Server::publish(cl, t);
+          busy = true;
+        }
+      }
+      me.passes.store(me.passes.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+      if (busy) {
+        me.busyPasses.store(me.busyPasses.load(std::memory_order_relaxed) + 1,
+                            std::memory_order_relaxed);
+      }
+      if (k != 0) {
+        continue;
+      }
+
+      // The leader adapts the pool at the end of every window:
+      uint64_t now = __rdtsc();
+      if (now - windowStart < windowTicks) {
+        continue;
+      }
+      windowStart = now;
+      uint64_t passes = 0;
+      uint64_t busyPasses = 0;
+      for (uint32_t j = 0; j < maxServers; ++j) {
+        uint64_t p = perServer[j].passes.load(std::memory_order_relaxed);
+        uint64_t b = perServer[j].busyPasses.load(std::memory_order_relaxed);
+        passes += p - lastPasses[j];
+        busyPasses += b - lastBusy[j];
+        lastPasses[j] = p;
+        lastBusy[j] = b;
+      }
+      double load = passes > 0 ? static_cast<double>(busyPasses) / passes : 0;
+      hot = load > highWater ? hot + 1 : 0;
+      cold = load < lowWater ? cold + 1 : 0;
+      if (hot >= sustain && n < maxServers) {
+        reconfigure(n + 1);
+        hot = 0;
+      } else if (cold >= sustain && n > 1) {
+        reconfigure(n - 1);
+        cold = 0;
+      } else if (registry.hasRetired()) {
+        reconfigure(n);
+      }
+    }
+  }
+};
+
+// Cross-process delegation: the client slots live in a memfd mapping,
+// which any process can map given the file descriptor (inherited, passed
+// over a Unix socket or opened as /proc/<pid>/fd/<fd>), and the server
+// process serves the requests of all of them. Nothing in the mapping is a
+// pointer. A client process claims a free slot by swapping its pid into
+// owner, and frees it by storing 0. The server checks every 10 ms that
+// the owners are still alive, and takes the slots of dead ones back,
+// dropping a request they may have left behind.
+class ShmServer {
+ public:
+  static constexpr uint64_t magic = 0x5345525645534c54ULL;
+
+  struct alignas(128) Slot {
+    std::atomic<uint32_t> owner;    // pid of the client process, 0 if free
+    std::atomic<uint32_t> inTick;   // an increase means that a new job
+                                    // has to be done
+    char padding[120];
+    std::atomic<uint32_t> outTick;  // an increase means that a new answer
+                                    // is there
+    uint64_t result;                // the sum of the work after the job
+    char padding2[116];
+  };
+
+  struct alignas(128) Header {
+    uint64_t magic;
+    uint32_t capacity;
+    std::atomic<uint32_t> used;     // indices ever claimed
+  };
+
+  // View of the mapping, in the server process or in a client process:
+  class Mapping {
+    Header* header;
+    size_t length;
+
+   public:
+    // Map the region behind fd, header is nullptr if that failed:
+    explicit Mapping(int fd) : header(nullptr), length(0) {
+      struct stat st;
+      if (fstat(fd, &st) != 0) {
+        return;
+      }
+      void* p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED) {
+        return;
+      }
+      length = st.st_size;
+      header = static_cast<Header*>(p);
+      if (header->magic != magic) {
+        munmap(p, length);
+        header = nullptr;
+      }
+    }
+
+    ~Mapping() {
+      if (header != nullptr) {
+        munmap(header, length);
+      }
+    }
+
+    Mapping(Mapping const&) = delete;
+    Mapping& operator=(Mapping const&) = delete;
+
+    bool valid() const {
+      return header != nullptr;
+    }
+
+    uint32_t capacity() const {
+      return header->capacity;
+    }
+
+    uint32_t used() const {
+      return header->used.load(std::memory_order_acquire);
+    }
+
+    Slot* slot(uint32_t i) const {
+      return reinterpret_cast<Slot*>(header + 1) + i;
+    }
+
+    // Claim a free slot for this process, nullptr if there is none:
+    Slot* registerClient() {
+      uint32_t pid = getpid();
+      for (uint32_t i = 0; i < header->capacity; ++i) {
+        uint32_t expected = 0;
+        Slot* s = slot(i);
+        if (s->owner.load(std::memory_order_relaxed) == 0 &&
+            s->owner.compare_exchange_strong(expected, pid,
+                                             std::memory_order_acquire)) {
+          uint32_t u = header->used.load(std::memory_order_relaxed);
+          while (u < i + 1 &&
+                 !header->used.compare_exchange_weak(
+                   u, i + 1, std::memory_order_release)) {
+          }
+          return s;
+        }
+      }
+      return nullptr;
+    }
+
+    // Free s, which must not have a request outstanding:
+    void unregisterClient(Slot* s) {
+      s->owner.store(0, std::memory_order_release);
+    }
+
+    // Have the server do a unit of work and wait for the answer:
+    uint64_t execute(Slot* s) {
+      uint32_t t = s->inTick.load(std::memory_order_relaxed) + 1;
+      s->inTick.store(t, std::memory_order_release);
+      SpinWait::wait(&s->outTick, t, nullptr);
+      return s->result;
+    }
+  };
+
+ private:
+  int fd;
+  Mapping* mapping;
+  Work* work;
+  std::vector<uint32_t> ticks;       // server's copy of inTick per index
+  std::atomic<uint32_t> stop;
+  std::atomic<uint64_t> nrReclaimed;
+  std::thread server;
+
+  static size_t regionSize(uint32_t capacity) {
+    return sizeof(Header) + capacity * sizeof(Slot);
+  }
+
+  static int createRegion(uint32_t capacity) {
+    int f = memfd_create("servertest", 0);
+    if (f < 0) {
+      return -1;
+    }
+    if (ftruncate(f, regionSize(capacity)) != 0) {
+      close(f);
+      return -1;
+    }
+    void* p = mmap(nullptr, regionSize(capacity), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, f, 0);
+    if (p == MAP_FAILED) {
+      close(f);
+      return -1;
+    }
+    Header* h = new (p) Header();   // the file is zero filled, so are the
+    h->capacity = capacity;         // slots
+    h->used.store(0, std::memory_order_relaxed);
+    h->magic = magic;
+    munmap(p, regionSize(capacity));
+    return f;
+  }
+
+  // Whether the process pid still runs, a zombie does not count:
+  static bool alive(uint32_t pid) {
+    if (kill(pid, 0) != 0 && errno == ESRCH) {
+      return false;
+    }
+    std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    std::getline(in, line);
+    size_t paren = line.rfind(')');
+    return paren == std::string::npos || paren + 2 >= line.size() ||
+           line[paren + 2] != 'Z';
+  }
+
+  // Free the slots of dead owners. The owner may have unregistered and
+  // another process claimed the slot while alive() ran, so the slot is
+  // only freed if it still belongs to pid. Its last tick is read before,
+  // as a new owner may post right after:
+  void reclaimDead() {
+    uint32_t u = mapping->used();
+    for (uint32_t i = 0; i < u; ++i) {
+      Slot* s = mapping->slot(i);
+      uint32_t pid = s->owner.load(std::memory_order_acquire);
+      if (pid == 0 || alive(pid)) {
+        continue;
+      }
+      uint32_t t = s->inTick.load(std::memory_order_acquire);
+      if (s->owner.compare_exchange_strong(pid, 0,
+                                           std::memory_order_acq_rel)) {
+        ticks[i] = t;
+        s->outTick.store(t, std::memory_order_relaxed);
+        nrReclaimed.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void run() {
+    uint64_t const checkTicks = static_cast<uint64_t>(tscPerNs * 1e7);
+    uint64_t lastCheck = __rdtsc();
+    while (stop.load(std::memory_order_relaxed) == 0) {
+      // Usual work:
+      uint32_t u = mapping->used();
+      for (uint32_t i = 0; i < u; ++i) {
+        Slot* s = mapping->slot(i);
+        uint32_t t = s->inTick.load(std::memory_order_acquire);
+        if (t != ticks[i]) {
+          ticks[i] = t;
+          work->dowork();
+          s->result = work->get();
+          s->outTick.store(t, std::memory_order_release);
+        }
+      }
+
+      // Dead clients?
+      uint64_t now = __rdtsc();
+      if (now - lastCheck > checkTicks) {
+        reclaimDead();
+        lastCheck = now;
+      }
+    }
+  }
+
+ public:
+  // Create the region for capacity clients and start the server thread,
+  // check valid() afterwards:
+  ShmServer(uint32_t capacity, Work* w)
+    : fd(createRegion(capacity)), mapping(nullptr), work(w),
+      ticks(capacity, 0), stop(0), nrReclaimed(0) {
+    if (fd >= 0) {
+      mapping = new Mapping(fd);
+      if (mapping->valid()) {
+        server = std::thread(&ShmServer::run, this);
+      }
+    }
+  }
+
+  ~ShmServer() {
+    stop = 1;
+    if (server.joinable()) {
+      server.join();
+    }
+    delete mapping;
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  bool valid() const {
+    return mapping != nullptr && mapping->valid();
+  }
+
+  // The memfd, a client process maps it with Mapping:
+  int fileDescriptor() const {
+    return fd;
+  }
+
+  // Number of slots taken back from dead client processes:
+  uint64_t reclaimed() const {
+    return nrReclaimed.load(std::memory_order_relaxed);
+  }
+};
+
+// What the client processes of a benchmark phase share with the parent,
+// in an anonymous shared mapping:
+struct ProcessResults {
+  static constexpr int maxProcesses = 256;
+  std::atomic<int> stop;
+  uint64_t counts[maxProcesses];
+  uint64_t sums[maxProcesses];
+  Histogram hists[maxProcesses];
+};
+
+// Body of client process i: map the server's region, work as client
+// until stop is signalled and leave count and latencies in results. If
+// crashAfter is not 0, post one more request after that many and die
+// without waiting for it or freeing the slot. Runs after fork(), so it
+// must not allocate:
+void shmClientProcess(int fd, ProcessResults* results, int i,
+                      uint64_t crashAfter) {
+  ShmServer::Mapping mapping(fd);
+  ShmServer::Slot* s = mapping.valid() ? mapping.registerClient() : nullptr;
+  if (s == nullptr) {
+    return;
+  }
+  uint64_t c = 0;
+  uint64_t sum = 0;
+  Histogram& h = results->hists[i];
+  uint64_t last = __rdtsc();
+  size_t perRound = ceill(1e-5 / workTime);
+  while (results->stop.load(std::memory_order_relaxed) == 0) {
+    for (size_t j = 0; j < perRound; ++j) {
+      if (crashAfter != 0 && c == crashAfter) {
+        s->inTick.store(s->inTick.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_release);
+        raise(SIGKILL);
+      }
+      sum += mapping.execute(s);
+      ++c;
+      last = h.recordSince(last);
+    }
+  }
+  mapping.unregisterClient(s);
+  results->counts[i] = c;
+  results->sums[i] = sum;
+}
+
+// Coroutine front-end for delegation: a Task is a coroutine which
+// delegates by co_awaiting scheduler.await(server.submit(client)). A
+// Scheduler runs many tasks in one thread, polls the futures they are
+// suspended on and resumes them when their answer has arrived, so one
+// thread can keep many delegated requests in flight.
+class Task {
+ public:
+  struct promise_type {
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() { }
+    void unhandled_exception() { std::terminate(); }
+  };
+
+ private:
+  std::coroutine_handle<promise_type> handle;
+
+ public:
+  explicit Task(std::coroutine_handle<promise_type> h) : handle(h) { }
+  Task(Task&& other) : handle(other.handle) { other.handle = nullptr; }
+  Task(Task const&) = delete;
+  Task& operator=(Task const&) = delete;
+  ~Task() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  std::coroutine_handle<> coroutine() const {
+    return handle;
+  }
+};
+
+class Scheduler {
+  struct Waiting {
+    std::coroutine_handle<> coroutine;
+    Server::Future future;
+  };
+  std::vector<std::coroutine_handle<>> runnable;
+  std::vector<Waiting> waiting;
+
+ public:
+  class Awaiter {
+    Scheduler* scheduler;
+    Server::Future future;
+
+   public:
+    Awaiter(Scheduler* s, Server::Future f) : scheduler(s), future(f) { }
+    bool await_ready() const { return future.ready(); }
+    void await_suspend(std::coroutine_handle<> h) {
+      scheduler->waiting.push_back(Waiting{h, future});
+    }
+    void await_resume() const { }
+  };
+
+  Awaiter await(Server::Future f) {
+    return Awaiter(this, f);
+  }
+
+  void spawn(Task const& task) {
+    runnable.push_back(task.coroutine());
+  }
+
+  // Run until all tasks have finished:
+  void run() {
+    for (size_t i = 0; i < runnable.size(); ++i) {
+      runnable[i].resume();
+    }
+    runnable.clear();
+    while (!waiting.empty()) {
+      size_t i = 0;
+      while (i < waiting.size()) {
+        if (waiting[i].future.ready()) {
+          std::coroutine_handle<> h = waiting[i].coroutine;
+          waiting[i] = waiting.back();
+          waiting.pop_back();
+          h.resume();  // may append to waiting again
+        } else {
+          ++i;
+        }
+      }
+    }
+  }
+};
+
+Task delegatingTask(Scheduler* scheduler, Server* server,
+                    Server::Client* cl, std::atomic<int>* stop,
+                    uint64_t* count, Histogram* hist) {
+  while (stop->load(std::memory_order_relaxed) == 0) {
+    uint64_t start = __rdtsc();
+    co_await scheduler->await(server->submit(cl));
+    hist->record(__rdtsc() - start);
+    ++*count;
+  }
+}
+
+// Client thread which interleaves coros coroutines, each with its own
+// Client slot and one request in flight:
+void coroutineClientThread(Server* server, Work* work, int coros,
+                           std::atomic<int>* stop, uint64_t* count,
+                           Histogram* hist) {
+  std::vector<Server::Client*> cls;
+  std::vector<Task> tasks;
+  Scheduler scheduler;
+  uint64_t c = 0;
+  Histogram h;
+  for (int i = 0; i < coros; ++i) {
+    cls.push_back(new Server::Client(work));
+    server->registerClient(cls[i]);
+    tasks.push_back(delegatingTask(&scheduler, server, cls[i], stop, &c, &h));
+    scheduler.spawn(tasks[i]);
+  }
+  scheduler.run();
+  for (int i = 0; i < coros; ++i) {
+    server->unregisterClient(cls[i]);
+  }
+  *count = c;
+  *hist = h;
+}
+
+// Client which keeps connecting to the server, does one request and
+// disconnects again:
+void churnThread(Server* server, Work* work, std::atomic<int>* stop,
+                 uint64_t* count) {
+  uint64_t c = 0;
+  while (stop->load(std::memory_order_relaxed) == 0) {
+    Server::Client* cl = new Server::Client(work);
+    if (!server->registerClient(cl)) {
+      delete cl;
+      continue;
+    }
+    server->submit(cl).wait();
+    server->unregisterClient(cl);
+    ++c;
+  }
+  *count = c;
+}
+
+// Flat combining: there is no dedicated server thread. Clients post their
+// requests into the same Client slots as for the Server, and whichever
+// waiting client grabs the combiner flag scans all slots and does the
+// pending work for everybody.
+class Combiner {
+ public:
+  typedef Server::Client Client;
+
+ private:
+  std::atomic<uint32_t> combining;  // 1 while some client is the combiner
+  char padding[124];                // just to go to other cache line
+
+  // Only the combiner may touch these:
+  std::vector<Client*> clients;
+  std::vector<uint32_t> ticks;
+
+ public:
+  Combiner() : combining(0) { }
+
+  void registerClient(Client* c) {
+    lock();
+    clients.push_back(c);
+    ticks.push_back(c->inTick.load(std::memory_order_relaxed));
+    unlock();
+  }
+
+  void unregisterClient(Client* c) {
+    lock();
+    for (size_t j = 0; j < clients.size(); ++j) {
+      if (clients[j] == c) {
+        clients[j] = clients.back();
+        clients.pop_back();
+        ticks[j] = ticks.back();
+        ticks.pop_back();
+        break;
+      }
+    }
+    unlock();
+  }
+
+  // Post the request with tick t in slot cl and return when it is done,
+  // either by another combiner or by ourselves:
+  void execute(Client* cl, uint32_t t) {
+    cl->inTick.store(t, std::memory_order_release);
+    while (cl->outTick.load(std::memory_order_acquire) != t) {
+      if (combining.load(std::memory_order_relaxed) == 0 &&
+          combining.exchange(1, std::memory_order_acquire) == 0) {
+        combine();
+        combining.store(0, std::memory_order_release);
+      }
+    }
+  }
+
+ private:
+  void lock() {
+    while (combining.load(std::memory_order_relaxed) != 0 ||
+           combining.exchange(1, std::memory_order_acquire) != 0) {
+    }
+  }
+
+  void unlock() {
+    combining.store(0, std::memory_order_release);
+  }
+
+  void combine() {
+    size_t s = clients.size();
+    for (size_t i = 0; i < s; ++i) {
+      uint32_t t = clients[i]->inTick.load(std::memory_order_acquire);
+      if (t != ticks[i]) {
+        ticks[i] = t;
+        clients[i]->work->dowork();
+        clients[i]->outTick.store(t, std::memory_order_release);
+      }
+    }
+  }
+};
+
+void combinerThread(Combiner* combiner, Work* work, std::atomic<int>* stop,
+                    uint64_t* count, Histogram* hist) {
+  Combiner::Client* cl = new Combiner::Client(work);
+  combiner->registerClient(cl);
+  // simply work as client until stop is signalled:
+  uint64_t c = 0;
+  Histogram h;
+  uint64_t last = __rdtsc();
+  size_t perRound = ceill(1e-5 / workTime);
+  uint32_t t = 0;
+  while (stop->load(std::memory_order_relaxed) == 0) {
+    for (size_t i = 0; i < perRound; ++i) {
+      combiner->execute(cl, ++t);
+      ++c;
+      last = h.recordSince(last);
+    }
+  }
+  combiner->unregisterClient(cl);
+  delete cl;
+  *count = c;
+  *hist = h;
+}
+
+// Pipelined delegation: every client owns a single-producer/single-consumer
+// ring of request slots, so it can have several requests outstanding. The
+// server drains a whole ring in one visit and publishes all completions
+// with one store, which amortizes the cache line transfers over a batch.
+class PipelinedServer {
+ public:
+  static constexpr uint32_t ringSize = 16;  // must be a power of two
+
+  struct Slot {
+    uint32_t what;     // indicates what to do
+    uint64_t result;   // sum of the work after the request, set by server
+  };
+
+  struct alignas(128) Client {
+    std::atomic<uint32_t> head;  // number of requests posted, only the
+                                 // client writes it
+    Work* work;
+    char padding[120 - sizeof(Work*)];
+    std::atomic<uint32_t> tail;  // number of requests done, only the
+                                 // server writes it
+    std::atomic<uint32_t> serverGone;
+    uint32_t slot;               // index in the registry
+    char padding2[116];
+    Slot ring[ringSize];
+    Client(Work* w) : head(0), work(w), tail(0), serverGone(0), slot(0) { }
+
+    // Post a request, returns false if the ring is full:
+    bool post(uint32_t what) {
+      uint32_t h = head.load(std::memory_order_relaxed);
+      if (h - tail.load(std::memory_order_acquire) == ringSize) {
+        return false;
+      }
+      ring[h & (ringSize - 1)].what = what;
+      head.store(h + 1, std::memory_order_release);
+      return true;
+    }
+  };
+
+ private:
+  ClientRegistry<Client> registry;
+  std::vector<uint32_t> tails;    // server's copy of the tail of each ring
+  std::atomic<uint32_t> stop;
+  std::thread server;
+
+ public:
+  PipelinedServer(uint32_t capacity = 1024)
+    : registry(capacity), tails(capacity, 0), stop(0),
+      server(&PipelinedServer::run, this) { }
+
+  ~PipelinedServer() {
+    stop = 1;
+    server.join();
+  }
+
+  // Publishes c to the server, returns false if there is no room for it:
+  bool registerClient(Client* c) {
+    c->slot = registry.add(c);
+    return c->slot != ~0u;
+  }
+
+  // Withdraws c, whose ring must be empty. The server deletes it:
+  void unregisterClient(Client* c) {
+    registry.remove(c->slot);
+  }
+
+  void run() {
+    while (true) {
+      registry.reclaim([this](uint32_t i) { tails[i] = 0; });
+
+      // Usual work, drain every ring completely:
+      uint32_t s = registry.size();
+      for (uint32_t i = 0; i < s; ++i) {
+        Client* cl = registry.get(i);
+        if (cl == nullptr) {
+          continue;
+        }
+        uint32_t h = cl->head.load(std::memory_order_acquire);
+        uint32_t t = tails[i];
+        if (t != h) {
+          do {
+            Slot& slot = cl->ring[t & (ringSize - 1)];
+            if (slot.what != 0) {
+              cl->work->dowork();
+            }
+            slot.result = cl->work->get();
+            ++t;
+          } while (t != h);
+          tails[i] = t;
+          cl->tail.store(t, std::memory_order_release);
+        }
+      }
+
+      // Stop?
+      if (stop.load(std::memory_order_relaxed) > 0) {
+        for (uint32_t i = 0; i < s; ++i) {
+          Client* cl = registry.get(i);
+          if (cl != nullptr) {
+            cl->serverGone = 1;
+          }
+        }
+        break;
+      }
+    }
+  }
+};
+
+// Client which keeps up to depth requests in flight and collects their
+// results as they come in:
+void pipelinedClientThread(PipelinedServer* server, Work* work,
+                           uint32_t depth, std::atomic<int>* stop,
+                           uint64_t* count, Histogram* hist) {
+  PipelinedServer::Client* cl = new PipelinedServer::Client(work);
+  server->registerClient(cl);
+  uint64_t postTsc[PipelinedServer::ringSize];
+  uint64_t c = 0;
+  uint64_t sum = 0;
+  Histogram h;
+  size_t perRound = ceill(1e-5 / workTime);
+  uint32_t done = 0;   // number of results collected
+  while (stop->load(std::memory_order_relaxed) == 0) {
+    for (size_t i = 0; i < perRound; ++i) {
+      // Fill the pipeline:
+      uint32_t head = cl->head.load(std::memory_order_relaxed);
+      while (head - done < depth) {
+        postTsc[head & (PipelinedServer::ringSize - 1)] = __rdtsc();
+        cl->post(2);
+        ++head;
+      }
+      // Wait for at least one answer and collect all which are there:
+      uint32_t tail;
+      while ((tail = cl->tail.load(std::memory_order_acquire)) == done) {
+      }
+      uint64_t now = __rdtsc();
+      do {
+        uint32_t pos = done & (PipelinedServer::ringSize - 1);
+        sum += cl->ring[pos].result;
+        h.record(now - postTsc[pos]);
+        ++done;
+        ++c;
+      } while (done != tail);
+    }
+  }
+  // Collect what is still in flight:
+  while (cl->tail.load(std::memory_order_acquire) !=
+         cl->head.load(std::memory_order_relaxed)) {
+  }
+  server->unregisterClient(cl);
+  *count = c;
+  resultSink.fetch_add(sum, std::memory_order_relaxed);
+  *hist = h;
+}
+
+// Typed delegation: the server owns a Work and a map of counters, and
+// clients delegate real operations with arguments and results to it.
+struct CountingState {
+  Work work;
+  std::unordered_map<uint64_t, uint64_t> counters;
+  CountingState(size_t howmuch) : work(howmuch) { }
+};
+
+// Do a unit of work and count it under key, returns the new count:
+struct CountWork {
+  using Result = uint64_t;
+  uint64_t key;
+  uint64_t operator()(CountingState& s) const {
+    s.work.dowork();
+    return ++s.counters[key];
+  }
+};
+
+// Look up the count under key:
+struct GetCount {
+  using Result = uint64_t;
+  uint64_t key;
+  uint64_t operator()(CountingState& s) const {
+    auto it = s.counters.find(key);
+    return it == s.counters.end() ? 0 : it->second;
+  }
+};
+
+// Reset the count under key:
+struct ResetCount {
+  using Result = void;
+  uint64_t key;
+  void operator()(CountingState& s) const {
+    s.counters.erase(key);
+  }
+};
+
+typedef DelegationServer<CountingState, CountWork, GetCount, ResetCount>
+  CountingServer;
+
+void typedClientThread(CountingServer* server, uint64_t key,
+                       std::atomic<int>* stop, uint64_t* count,
+                       Histogram* hist) {
+  CountingServer::Client* cl = new CountingServer::Client();
+  server->registerClient(cl);
+  server->call(cl, ResetCount{key});
+  // simply work as client until stop is signalled:
+  uint64_t c = 0;
+  Histogram h;
+  uint64_t last = __rdtsc();
+  size_t perRound = ceill(1e-5 / workTime);
+  while (stop->load(std::memory_order_relaxed) == 0) {
+    for (size_t i = 0; i < perRound; ++i) {
+      server->call(cl, CountWork{key});
+      ++c;
+      last = h.recordSince(last);
+    }
+  }
+  if (server->call(cl, GetCount{key}) != c) {
+    std::cerr << "Warning: count of " << key << " is wrong!" << std::endl;
+  }
+  server->unregisterClient(cl);
+  *count = c;
+  *hist = h;
+}
+
+// Read/write delegation: the server owns a Work and a table of values,
+// writes do a unit of work and bump a value, reads look a value up. The
+// values are relaxed atomics, so that reads can bypass the server under
+// its seqlock:
+struct TableState {
+  static constexpr size_t size = 64;
+  Work work;
+  std::atomic<uint64_t> values[size];
+  TableState(size_t howmuch) : work(howmuch) {
+    for (size_t i = 0; i < size; ++i) {
+      values[i].store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+// Do a unit of work and count it under key:
+struct AddValue {
+  using Result = void;
+  uint64_t key;
+  void operator()(TableState& s) const {
+    s.work.dowork();
+    std::atomic<uint64_t>& v = s.values[key % TableState::size];
+    v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+};
+
+// Look up the count under key, bypassing the server:
+struct ReadValue {
+  using Result = uint64_t;
+  static constexpr bool readOnly = true;
+  uint64_t key;
+  uint64_t operator()(TableState const& s) const {
+    return s.values[key % TableState::size].load(std::memory_order_relaxed);
+  }
+};
+
+// The same, but delegated like a write:
+struct ReadValueDelegated {
+  using Result = uint64_t;
+  uint64_t key;
+  uint64_t operator()(TableState& s) const {
+    return s.values[key % TableState::size].load(std::memory_order_relaxed);
+  }
+};
+
+typedef DelegationServer<TableState, AddValue, ReadValue, ReadValueDelegated>
+  TableServer;
+
+// Client doing readPct reads out of 100 operations, delegated ones or ones
+// bypassing the server:
+void readWriteClientThread(TableServer* server, uint64_t key,
+                           unsigned readPct, bool bypass,
+                           std::atomic<int>* stop, uint64_t* count,
+                           Histogram* hist) {
+  TableServer::Client* cl = new TableServer::Client();
+  server->registerClient(cl);
+  // simply work as client until stop is signalled:
+  uint64_t c = 0;
+  uint64_t sum = 0;
+  Histogram h;
+  uint64_t last = __rdtsc();
+  size_t perRound = ceill(1e-5 / workTime);
+  while (stop->load(std::memory_order_relaxed) == 0) {
+    for (size_t i = 0; i < perRound; ++i) {
+      if (c % 100 >= readPct) {
+        server->call(cl, AddValue{key});
+      } else if (bypass) {
+        sum += server->call(cl, ReadValue{key});
+      } else {
+        sum += server->call(cl, ReadValueDelegated{key});
+      }
+      ++c;
+      last = h.recordSince(last);
+    }
+  }
+  server->unregisterClient(cl);
+  resultSink.fetch_add(sum, std::memory_order_relaxed);
+  *count = c;
+  *hist = h;
+}
+
+// Sharded delegation: the data behind Work is split into several shards,
+// each of which is owned by its own Server thread. A client holds one
+// Client slot per server and sends each request to the server which owns
+// the key of the request.
+void shardedClientThread(std::vector<std::unique_ptr<Server>>* servers,
+                         std::vector<std::unique_ptr<Work>>* shards,
+                         std::atomic<int>* stop, uint64_t* count,
+                         Histogram* hist, uint64_t seed) {
+  size_t k = servers->size();
+  std::vector<Server::Client*> cls;
+  std::vector<uint32_t> ts;
+  cls.reserve(k);
+  ts.reserve(k);
+  for (size_t i = 0; i < k; ++i) {
+    cls.push_back(new Server::Client((*shards)[i].get()));
+    ts.push_back(0);
+    (*servers)[i]->registerClient(cls[i]);
+  }
+  // simply work as client until stop is signalled:
+  uint64_t c = 0;
+  Histogram h;
+  uint64_t last = __rdtsc();
+  size_t perRound = ceill(1e-5 / workTime);
+  uint64_t key = seed | 1;
+  while (stop->load(std::memory_order_relaxed) == 0) {
+    for (size_t i = 0; i < perRound; ++i) {
+      key ^= key << 13;   // xorshift64 to spread the keys over the shards
+      key ^= key >> 7;
+      key ^= key << 17;
+      size_t s = key % k;
+      Server::Client* cl = cls[s];
+      uint32_t t = ++ts[s];
+      cl->postedAt = __rdtsc();
+      cl->inTick.store(t, std::memory_order_relaxed);
+      (*servers)[s]->notify(cl);
+      while (cl->outTick.load(std::memory_order_relaxed) != t) {
+      }
+      ++c;
+      last = h.recordSince(last);
+    }
+  }
+  for (size_t i = 0; i < k; ++i) {
+    (*servers)[i]->unregisterClient(cls[i]);
+  }
+  *count = c;
+  *hist = h;
+}
+
+// Open-loop load: requests arrive on a schedule which does not wait for
+// the answers, like independent users do. Arrivals produces the intended
+// send times of one client in TSC ticks, either evenly spaced or with
+// exponentially distributed gaps (a Poisson process).
+class Arrivals {
+  bool poisson;
+  double meanGap;   // in TSC ticks
+  double next;
+  std::mt19937_64 rng;
+  std::exponential_distribution<double> gap;   // with mean 1
+
+ public:
+  // rate is in requests per second, the first request is due at start:
+  Arrivals(bool p, double rate, uint64_t start, uint64_t seed)
+    : poisson(p), meanGap(tscPerNs * 1e9 / rate), next(start), rng(seed),
+      gap(1.0) { }
+
+  uint64_t current() const {
+    return static_cast<uint64_t>(next);
+  }
+
+  void advance() {
+    next += poisson ? meanGap * gap(rng) : meanGap;
+  }
+};
+
+// Issue request() at the times given by arrivals until stop is signalled.
+// A request which is due while the previous one is still running is sent
+// as soon as that one is done, and every latency is measured from the
+// intended send time, so the queueing delay a slow request causes for the
+// ones behind it is not omitted:
+template <typename Request>
+void openLoopClient(Arrivals arrivals, Request request, std::atomic<int>* stop,
+                    uint64_t* count, Histogram* hist) {
+  uint64_t const sleepTicks = static_cast<uint64_t>(tscPerNs * 100000);
+  uint64_t c = 0;
+  Histogram h;
+  while (stop->load(std::memory_order_relaxed) == 0) {
+    uint64_t intended = arrivals.current();
+    uint64_t now = __rdtsc();
+    // Sleep through long gaps, but spin for the last stretch:
+    if (intended > now + sleepTicks) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(
+        static_cast<uint64_t>((intended - now - sleepTicks / 2) / tscPerNs)));
+      continue;
+    }
+    while (now < intended && stop->load(std::memory_order_relaxed) == 0) {
+      _mm_pause();
+      now = __rdtsc();
+    }
+    if (now < intended) {
+      break;
+    }
+    request();
+    h.record(__rdtsc() - intended);
+    ++c;
+    arrivals.advance();
+  }
+  *count = c;
+  *hist = h;
+}
+
+// Result of one measured phase, in which some threads do operations for
+// the test time:
+struct PhaseResult {
+  std::string section;   // what was measured, e.g. "lock"
+  std::string variant;   // with which parameters, e.g. "mcs"
+  std::string note;      // details for humans, e.g. the CPUs used
+  int threads;
+  double seconds;
+  uint64_t ops;
+  std::vector<uint64_t> counts;  // operations per thread
+  std::vector<uint64_t> maxWaits;  // longest latency per thread, in ticks
+  Histogram latency;             // of all threads, in TSC ticks
+  std::vector<std::pair<std::string, double>> perfPerOp;
+  std::vector<std::pair<std::string, double>> extra;  // section specific
+  PhaseResult() : threads(0), seconds(0.0), ops(0) { }
+};
+
+// The measurement loop: run body(i, stop, count, hist) in the threads
+// i = 0, ..., j - 1 for testTime seconds, then signal stop, join them and
+// collect their counts, their latencies and the performance counters:
+template <typename Body>
+PhaseResult runPhase(char const* section, std::string const& variant, int j,
+                     double testTime, Body body) {
+  std::chrono::high_resolution_clock clock;
+  PhaseResult r;
+  r.section = section;
+  r.variant = variant;
+  r.threads = j;
+  r.counts.assign(j, 0);
+  std::vector<Histogram> hists(j);
+  std::vector<std::thread> ts;
+  ts.reserve(j);
+  std::atomic<int> stop(0);
+  perf.start();
+  auto startTime = clock.now();
+  for (int i = 0; i < j; ++i) {
+    ts.emplace_back([&body, &stop, &r, &hists, i]() {
+      body(i, &stop, &r.counts[i], &hists[i]);
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::duration<double>(testTime));
+  stop.store(1);
+  for (int i = 0; i < j; ++i) {
+    ts[i].join();
+  }
+  auto endTime = clock.now();
+  perf.stop();
+  r.seconds = std::chrono::duration<double>(endTime - startTime).count();
+  for (int i = 0; i < j; ++i) {
+    r.ops += r.counts[i];
+    r.latency.merge(hists[i]);
+    r.maxWaits.push_back(hists[i].max());
+  }
+  r.perfPerOp = perf.perOp(r.ops);
+  return r;
+}
+
+// Jain's fairness index of the operation counts x: (sum x)^2 / (n sum x^2),
+// 1 if all are equal, 1/n if one thread did everything:
+double jainIndex(std::vector<uint64_t> const& x) {
+  double sum = 0.0;
+  double squares = 0.0;
+  for (uint64_t v : x) {
+    sum += static_cast<double>(v);
+    squares += static_cast<double>(v) * static_cast<double>(v);
+  }
+  return squares > 0.0 ? sum * sum / (x.size() * squares) : 1.0;
+}
+
+enum class Format { Text, Json, Csv };
+
+// Writes the configuration of the run and the results of all phases. Text
+// is for reading, JSON and CSV are for plotting and for diffing runs. The
+// output is streamed, so an interrupted run still leaves all finished
+// phases behind.
+class Reporter {
+  Format format;
+  bool first;   // no result written yet
+
+  static std::string number(double v) {
+    if (!std::isfinite(v)) {
+      return "";
+    }
+    std::ostringstream os;
+    os.precision(10);
+    os << v;
+    return os.str();
+  }
+
+  static std::string quote(std::string const& s) {
+    std::string r = "\"";
+    for (char c : s) {
+      if (c == '"' || c == '\\') {
+        r += '\\';
+        r += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        r += ' ';
+      } else {
+        r += c;
+      }
+    }
+    return r + "\"";
+  }
+
+  static std::string jsonNumber(double v) {
+    std::string n = number(v);
+    return n.empty() ? "null" : n;
+  }
+
+  static std::string jsonValue(std::string const& s) {
+    char* end = nullptr;
+    strtod(s.c_str(), &end);
+    bool numeric = !s.empty() && end == s.c_str() + s.size();
+    return numeric ? s : quote(s);
+  }
+
+  static std::string jsonObject(
+      std::vector<std::pair<std::string, double>> const& pairs) {
+    std::string r = "{";
+    for (size_t i = 0; i < pairs.size(); ++i) {
+      r += (i > 0 ? ", " : "") + quote(pairs[i].first) + ": " +
+           jsonNumber(pairs[i].second);
+    }
+    return r + "}";
+  }
+
+  static std::string csvField(std::string const& s) {
+    if (s.find_first_of(",\"\n") == std::string::npos) {
+      return s;
+    }
+    std::string r = "\"";
+    for (char c : s) {
+      r += c == '"' ? std::string("\"\"") : std::string(1, c);
+    }
+    return r + "\"";
+  }
+
+  static std::string csvList(
+      std::vector<std::pair<std::string, double>> const& pairs) {
+    std::string r;
+    for (size_t i = 0; i < pairs.size(); ++i) {
+      r += (i > 0 ? ";" : "") + pairs[i].first + "=" +
+           number(pairs[i].second);
+    }
+    return csvField(r);
+  }
+
+ public:
+  static uint64_t ns(uint64_t ticks) {
+    return static_cast<uint64_t>(ticks / tscPerNs);
+  }
+
+  explicit Reporter(Format f) : format(f), first(true) { }
+
+  void begin(std::vector<std::pair<std::string, std::string>> const& config) {
+    switch (format) {
+      case Format::Text:
+        for (auto const& c : config) {
+          std::cout << c.first << ": " << c.second << std::endl;
+        }
+        std::cout << std::endl;
+        break;
+      case Format::Json:
+        std::cout << "{\"config\": {";
+        for (size_t i = 0; i < config.size(); ++i) {
+          std::cout << (i > 0 ? ", " : "") << quote(config[i].first) << ": "
+            << jsonValue(config[i].second);
+        }
+        std::cout << "},\n\"results\": [" << std::flush;
+        break;
+      case Format::Csv:
+        for (auto const& c : config) {
+          std::cout << "# " << c.first << "=" << c.second << std::endl;
+        }
+        std::cout << "section,variant,note,threads,seconds,ops,ns_per_op,"
+          "p50_ns,p99_ns,p999_ns,max_ns,thread_counts,jain,max_wait_ns,"
+          "perf_per_op,extra"
+          << std::endl;
+        break;
+    }
+  }
+
+  // Start a group of phases, only the text report shows it:
+  void section(std::string const& title) {
+    if (format == Format::Text) {
+      std::cout << title << "..." << std::endl;
+    }
+  }
+
+  // Remark for humans, only the text report shows it:
+  void message(std::string const& text) {
+    if (format == Format::Text) {
+      std::cout << "  " << text << "\n" << std::endl;
+    }
+  }
+
+  void result(PhaseResult const& r) {
+    double nsPerOp = r.seconds / static_cast<double>(r.ops) * 1e9;
+    Histogram const& h = r.latency;
+    switch (format) {
+      case Format::Text:
+        std::cout << "Using " << r.threads << " threads" << r.note << ":"
+          << std::endl;
+        std::cout << "  time="
+          << r.seconds << "s " << pretty(r.ops)
+          << " iterations, time per iteration: " << floorl(nsPerOp) << " ns"
+          << std::endl;
+        if (r.counts.size() > 1) {
+          std::cout << "  thread counts:";
+          for (uint64_t c : r.counts) {
+            std::cout << " " << pretty(c);
+          }
+          std::cout << std::endl;
+          std::cout << "  fairness: jain=" << jainIndex(r.counts);
+          if (!r.maxWaits.empty()) {
+            std::cout << " max wait per thread:";
+            for (uint64_t w : r.maxWaits) {
+              std::cout << " " << pretty(ns(w));
+            }
+            std::cout << " ns";
+          }
+          std::cout << std::endl;
+        }
+        printLatencies(h);
+        if (!r.perfPerOp.empty()) {
+          std::cout << "  per op:";
+          for (auto const& p : r.perfPerOp) {
+            std::cout << " " << p.first << "=" << floorl(p.second * 100) / 100;
+          }
+          std::cout << std::endl;
+        }
+        for (auto const& e : r.extra) {
+          std::cout << "  " << e.first << ": ";
+          if (e.second == floor(e.second) && fabs(e.second) < 1e15) {
+            std::cout << static_cast<int64_t>(e.second) << std::endl;
+          } else {
+            std::cout << e.second << std::endl;
+          }
+        }
+        std::cout << std::endl;
+        break;
+      case Format::Json:
+        std::cout << (first ? "\n  " : ",\n  ") << "{\"section\": "
+          << quote(r.section) << ", \"variant\": " << quote(r.variant)
+          << ", \"note\": " << quote(r.note) << ", \"threads\": " << r.threads
+          << ", \"seconds\": " << jsonNumber(r.seconds) << ", \"ops\": "
+          << r.ops << ", \"ns_per_op\": " << jsonNumber(nsPerOp)
+          << ", \"thread_counts\": [";
+        for (size_t i = 0; i < r.counts.size(); ++i) {
+          std::cout << (i > 0 ? ", " : "") << r.counts[i];
+        }
+        std::cout << "], \"jain\": " << jsonNumber(jainIndex(r.counts))
+          << ", \"max_wait_ns\": [";
+        for (size_t i = 0; i < r.maxWaits.size(); ++i) {
+          std::cout << (i > 0 ? ", " : "") << ns(r.maxWaits[i]);
+        }
+        std::cout << "], \"latency_ns\": {\"p50\": " << ns(h.percentile(0.5))
+          << ", \"p99\": " << ns(h.percentile(0.99)) << ", \"p99.9\": "
+          << ns(h.percentile(0.999)) << ", \"max\": " << ns(h.max())
+          << "}, \"perf_per_op\": " << jsonObject(r.perfPerOp)
+          << ", \"extra\": " << jsonObject(r.extra) << "}" << std::flush;
+        break;
+      case Format::Csv:
+        std::cout << csvField(r.section) << "," << csvField(r.variant) << ","
+          << csvField(r.note) << "," << r.threads << "," << number(r.seconds)
+          << "," << r.ops << "," << number(nsPerOp) << ","
+          << ns(h.percentile(0.5)) << "," << ns(h.percentile(0.99)) << ","
+          << ns(h.percentile(0.999)) << "," << ns(h.max()) << ",";
+        for (size_t i = 0; i < r.counts.size(); ++i) {
+          std::cout << (i > 0 ? " " : "") << r.counts[i];
+        }
+        std::cout << "," << number(jainIndex(r.counts)) << ",";
+        for (size_t i = 0; i < r.maxWaits.size(); ++i) {
+          std::cout << (i > 0 ? " " : "") << ns(r.maxWaits[i]);
+        }
+        std::cout << "," << csvList(r.perfPerOp) << "," << csvList(r.extra)
+          << std::endl;
+        break;
+    }
+    first = false;
+  }
+
+  void end() {
+    if (format == Format::Json) {
+      std::cout << "\n]}" << std::endl;
+    }
+  }
+};
+
+// What every measurement needs to know about the run:
+struct Bench {
+  Reporter* reporter;
+  Work* work;
+  size_t howmuch;
+  int threads;
+  int servers;
+  double testTime;
+};
+
+// Measure how a single thread fares without any locking:
+void measureSingle(Bench const& b) {
+  b.reporter->section("Running in a single thread without any locking");
+  b.reporter->result(runPhase("single", "", 1, b.testTime,
+    [&](int, auto stop, auto count, auto hist) {
+      singleThread(b.work, stop, count, hist);
+    }));
+}
+
+// Measure how multiple threads fare when using a lock of type Lock:
+template <typename Lock>
+void measureLock(Bench const& b, char const* name, char const* variant) {
+  b.reporter->section(std::string("Using multiple threads and ") + name);
+  for (int j = 1; j <= b.threads; ++j) {
+    Lock mutex;
+    b.reporter->result(runPhase("lock", variant, j, b.testTime,
+      [&](int, auto stop, auto count, auto hist) {
+        multipleThreads<Lock>(b.work, &mutex, stop, count, hist);
+      }));
+  }
+}
+
+// Measure a delegating server speaking protocol ("tick" or "what") whose
+// clients wait for answers with the strategy Wait:
+template <typename Wait>
+void measureDelegation(Bench const& b, std::string const& protocol,
+                       std::string const& wait, char const* name) {
+  b.reporter->section("Running in a single thread with delegation (" +
+                      protocol + " protocol) and " + name);
+  std::string variant = protocol + "/" + wait;
+  if (protocol == "what") {
+    WhatServer server(b.threads);  // start the server thread
+    for (int j = 1; j <= b.threads; ++j) {
+      b.reporter->result(runPhase("delegation", variant, j, b.testTime,
+        [&](int, auto stop, auto count, auto hist) {
+          whatClientThread<Wait>(&server, b.work, stop, count, hist);
+        }));
+    }
+  } else {
+    Server server;  // start the server thread
+    for (int j = 1; j <= b.threads; ++j) {
+      b.reporter->result(runPhase("delegation", variant, j, b.testTime,
+        [&](int, auto stop, auto count, auto hist) {
+          clientThread<Wait>(&server, b.work, stop, count, hist);
+        }));
+    }
+  }
+}
+
+// Measure a delegating server which does the requests it finds in a pass
+// one by one against one which batches them:
+void measureBatching(Bench const& b) {
+  for (bool batching : {false, true}) {
+    b.reporter->section(std::string("Running in a single thread with ") +
+                        (batching ? "batched" : "one by one") +
+                        " delegation");
+    Server server(IdlePolicy::spin(), 1024, ScanMode::Poll, batching);
+    for (int j = 1; j <= b.threads; ++j) {
+      uint64_t batchesBefore = server.batches();
+      uint64_t batchedBefore = server.batched();
+      PhaseResult r = runPhase("batch", batching ? "on" : "off", j,
+                               b.testTime,
+        [&](int, auto stop, auto count, auto hist) {
+          clientThread<SpinWait>(&server, b.work, stop, count, hist);
+        });
+      uint64_t batches = server.batches() - batchesBefore;
+      if (batches > 0) {
+        r.extra.emplace_back("average_batch",
+          static_cast<double>(server.batched() - batchedBefore) / batches);
       }
-      auto endTime = clock.now();
-      std::chrono::duration<double> runTime = endTime - startTime;
-      uint64_t count = 0;
+      b.reporter->result(r);
+    }
+  }
+}
+
+// Measure requests which carry a payload there and back, for powers of
+// two from 8 B to 4 KiB and the largest one which still goes inline,
+// inline in the client slot as far as it fits and in an arena of each
+// client which the server works on in place:
+void measurePayload(Bench const& b) {
+  std::vector<uint32_t> sizes;
+  for (uint32_t size = 8; size <= 4096; size *= 2) {
+    if (size > Server::inlineSize &&
+        (sizes.empty() || sizes.back() < Server::inlineSize)) {
+      sizes.push_back(Server::inlineSize);
+    }
+    sizes.push_back(size);
+  }
+  for (bool arena : {false, true}) {
+    b.reporter->section(std::string(
+      "Running in a single thread with delegation of payloads ") +
+      (arena ? "in a per-client arena" : "inline in the client slot"));
+    Server server;  // start the server thread
+    for (uint32_t size : sizes) {
+      if (!arena && size > Server::inlineSize) {
+        break;
+      }
+      PhaseResult r = runPhase("payload", (arena ? "arena/" : "inline/") +
+                               std::to_string(size), b.threads, b.testTime,
+        [&](int, auto stop, auto count, auto hist) {
+          payloadClientThread(&server, size, arena, stop, count, hist);
+        });
+      r.note = " and " + std::to_string(size) + " byte payloads";
+      r.extra.emplace_back("payload_bytes", size);
+      b.reporter->result(r);
+    }
+  }
+}
+
+// Measure what a server pass over 256 to 4096 polled clients costs, with
+// the slots from the heap or from a pool on huge pages. Of the clients,
+// up to THREADS are working, the others are idle. Every client has 4 KiB
+// of data of its own allocated along with its slot, which spreads heap
+// slots over the pages as in a real program. The dTLB misses come with
+// the perf counters:
+void measureSlotPool(Bench const& b) {
+  for (bool pooled : {false, true}) {
+    b.reporter->section(std::string(
+      "Running in a single thread with delegation, client slots from ") +
+      (pooled ? "a hugepage pool" : "the heap"));
+    for (int clients : {256, 1024, 4096}) {
+      int j = std::min(clients, b.threads);
+      Server server(IdlePolicy::spin(), clients + 64, ScanMode::Poll, false,
+                    pooled);
+      std::vector<std::unique_ptr<char[]>> ownData;
+      std::vector<Server::Client*> idlers;
+      for (int i = j; i < clients; ++i) {
+        ownData.emplace_back(new char[4096]);
+        idlers.push_back(server.newClient(b.work));
+        server.registerClient(idlers.back());
+      }
+      uint64_t passesBefore = server.passes();
+      double cpuBefore = server.cpuTime();
+      PhaseResult r = runPhase("slot-pool", pooled ? "pool" : "heap", j,
+                               b.testTime,
+        [&](int, auto stop, auto count, auto hist) {
+          clientThread<SpinWait>(&server, b.work, stop, count, hist);
+        });
+      uint64_t passes = server.passes() - passesBefore;
+      if (passes > 0) {
+        r.extra.emplace_back("scan_ns",
+          (server.cpuTime() - cpuBefore) * 1e9 / passes);
+      }
+      r.note = " of " + std::to_string(clients) + " clients";
+      r.extra.emplace_back("clients", clients);
+      if (pooled) {
+        r.extra.emplace_back("huge_pages", server.hugePages() ? 1 : 0);
+      }
+      for (Server::Client* cl : idlers) {
+        server.unregisterClient(cl);
+      }
+      b.reporter->result(r);
+    }
+  }
+}
+
+// Measure the tick protocol with the client slots laid out by Slots, for
+// 1 to 4096 clients. Of these, up to THREADS are working, the others are
+// idle and only make the scan longer:
+template <typename Slots>
+void measureLayout(Bench const& b) {
+  b.reporter->section(std::string(
+    "Running in a single thread with delegation, client slots laid out ") +
+    Slots::name);
+  for (int clients : {1, 4, 16, 64, 256, 1024, 4096}) {
+    int j = std::min(clients, b.threads);
+    LayoutServer<Slots> server(clients);  // start the server thread
+    for (int i = j; i < clients; ++i) {
+      server.registerClient(b.work);
+    }
+    uint64_t passesBefore = server.passes();
+    double cpuBefore = server.cpuTime();
+    PhaseResult r = runPhase("layout", Slots::name, j, b.testTime,
+      [&](int, auto stop, auto count, auto hist) {
+        layoutClientThread(&server, b.work, stop, count, hist);
+      });
+    uint64_t passes = server.passes() - passesBefore;
+    if (passes > 0) {
+      r.extra.emplace_back("scan_ns",
+        (server.cpuTime() - cpuBefore) * 1e9 / passes);
+    }
+    r.note = " of " + std::to_string(clients) + " clients";
+    r.extra.emplace_back("clients", clients);
+    b.reporter->result(r);
+  }
+}
+
+// Measure how the schedules share the server between latency critical and
+// bulk clients. The critical clients (QoS class 0) do the usual work, the
+// bulk clients' requests do 16 times as much. There are two mixes: every
+// fourth client critical, and more critical clients than a weighted round
+// takes, half of all. Reports Jain's index and the longest wait for each
+// group:
+void measureFairness(Bench const& b) {
+  Work bulkWork(b.work->getKind(), b.howmuch * 16, b.work->getFootprint());
+  int many = static_cast<int>(Server::qosWeights[0]) + 1;
+  for (Schedule sched : {Schedule::InOrder, Schedule::RoundRobin,
+                         Schedule::Weighted, Schedule::OldestFirst}) {
+    b.reporter->section(std::string(
+      "Running in a single thread with delegation to critical and bulk "
+      "clients, schedule ") + scheduleName(sched));
+    Server server(IdlePolicy::spin(), 1024, ScanMode::Poll, false, false,
+                  sched);
+    for (bool manyCritical : {false, true}) {
+      int j = manyCritical ? std::max(b.threads, 2 * many)
+                           : std::max(b.threads, 2);
+      int nrCritical = manyCritical ? j / 2 : (j + 3) / 4;
+      PhaseResult r = runPhase("fairness", scheduleName(sched), j,
+                               b.testTime,
+        [&](int i, auto stop, auto count, auto hist) {
+          bool critical = i < nrCritical;
+          clientThread<SpinWait>(&server, critical ? b.work : &bulkWork,
+                                 stop, count, hist, critical ? 0 : 1);
+        });
+      std::vector<uint64_t> counts[2];
+      uint64_t maxWait[2] = {0, 0};
       for (int i = 0; i < j; ++i) {
-        count += counts[i];
+        int k = i < nrCritical ? 0 : 1;
+        counts[k].push_back(r.counts[i]);
+        maxWait[k] = std::max(maxWait[k], r.maxWaits[i]);
+      }
+      r.note = ", " + std::to_string(nrCritical) + " of them critical";
+      r.extra.emplace_back("critical_clients", nrCritical);
+      r.extra.emplace_back("critical_jain", jainIndex(counts[0]));
+      r.extra.emplace_back("critical_max_wait_ns", Reporter::ns(maxWait[0]));
+      r.extra.emplace_back("bulk_jain", jainIndex(counts[1]));
+      r.extra.emplace_back("bulk_max_wait_ns", Reporter::ns(maxWait[1]));
+      b.reporter->result(r);
+    }
+  }
+  resultSink.fetch_add(bulkWork.get(), std::memory_order_relaxed);
+}
+
+// Measure the slot polling transport against the MPSC queue for 1 to 256
+// clients. Of these, up to THREADS are working, the others are idle,
+// which for polling means registered slots the server has to look at:
+void measureTransport(Bench const& b) {
+  for (bool queue : {false, true}) {
+    b.reporter->section(std::string(
+      "Running in a single thread with delegation over ") +
+      (queue ? "an MPSC queue" : "polled client slots"));
+    for (int clients : {1, 4, 16, 64, 256}) {
+      int j = std::min(clients, b.threads);
+      PhaseResult r;
+      if (queue) {
+        QueueServer server;  // start the server thread
+        r = runPhase("transport", "queue", j, b.testTime,
+          [&](int, auto stop, auto count, auto hist) {
+            queueClientThread(&server, b.work, stop, count, hist);
+          });
+      } else {
+        Server server(IdlePolicy::spin(), clients + 64);
+        std::vector<Server::Client*> idlers;
+        for (int i = j; i < clients; ++i) {
+          idlers.push_back(new Server::Client(b.work));
+          server.registerClient(idlers.back());
+        }
+        r = runPhase("transport", "poll", j, b.testTime,
+          [&](int, auto stop, auto count, auto hist) {
+            clientThread<SpinWait>(&server, b.work, stop, count, hist);
+          });
+        for (Server::Client* cl : idlers) {
+          server.unregisterClient(cl);
+        }
+      }
+      r.note = " of " + std::to_string(clients) + " clients";
+      r.extra.emplace_back("clients", clients);
+      b.reporter->result(r);
+    }
+  }
+}
+
+// Measure the elastic server pool with up to servers threads under a
+// phased load profile: quiet, burst, quiet, half load and burst again.
+// Every client has its own Work, since the partitions are served in
+// parallel. Reports how many servers are active at the end of a phase
+// and how long after its start the pool first reacted:
+void measureElastic(Bench const& b) {
+  b.reporter->section("Running with an elastic pool of up to " +
+                      std::to_string(b.servers) + " servers");
+  std::vector<std::unique_ptr<Work>> works;
+  for (int i = 0; i < b.threads; ++i) {
+    works.emplace_back(new Work(b.work->getKind(), b.howmuch,
+                                b.work->getFootprint() / b.threads));
+  }
+  struct Phase {
+    char const* name;
+    int clients;
+  };
+  Phase const profile[] = {{"quiet", 1}, {"burst", b.threads},
+                           {"quiet", 1}, {"half", (b.threads + 1) / 2},
+                           {"burst", b.threads}};
+  ElasticServer server(1024, b.servers);
+  for (Phase const& phase : profile) {
+    uint64_t phaseStart = __rdtsc();
+    uint32_t changesBefore = server.changeCount();
+    PhaseResult r = runPhase("elastic", phase.name, phase.clients,
+                             b.testTime,
+      [&](int i, auto stop, auto count, auto hist) {
+        clientThread<SpinWait>(&server, works[i].get(), stop, count, hist);
+      });
+    uint32_t changesAfter = server.changeCount();
+    r.note = std::string(", ") + phase.name + " phase";
+    r.extra.emplace_back("servers_at_end", server.activeServers());
+    r.extra.emplace_back("changes", changesAfter - changesBefore);
+    if (changesAfter > changesBefore) {
+      r.extra.emplace_back("reaction_ns",
+        floor((server.change(changesBefore).tsc - phaseStart) / tscPerNs));
+    }
+    b.reporter->result(r);
+  }
+  for (int i = 0; i < b.threads; ++i) {
+    resultSink.fetch_add(works[i]->get(), std::memory_order_relaxed);
+  }
+}
+
+// Measure mixes of reads and writes with readPct reads out of 100, with
+// a std::mutex, a std::shared_mutex, delegating everything and letting
+// the reads bypass the server under its seqlock:
+void measureReadWrite(Bench const& b, unsigned readPct) {
+  std::string ratio = std::to_string(readPct) + ":" +
+                      std::to_string(100 - readPct);
+  b.reporter->section("Using multiple threads and a std::mutex, " + ratio +
+                      " reads:writes");
+  for (int j = 1; j <= b.threads; ++j) {
+    std::mutex mutex;
+    b.reporter->result(runPhase("read-write", "mutex/" + ratio, j,
+                                b.testTime,
+      [&](int, auto stop, auto count, auto hist) {
+        multipleThreads<std::mutex>(b.work, &mutex, stop, count, hist,
+                                    readPct);
+      }));
+  }
+  b.reporter->section("Using multiple threads and a std::shared_mutex, " +
+                      ratio + " reads:writes");
+  for (int j = 1; j <= b.threads; ++j) {
+    std::shared_mutex mutex;
+    b.reporter->result(runPhase("read-write", "shared_mutex/" + ratio, j,
+                                b.testTime,
+      [&](int, auto stop, auto count, auto hist) {
+        multipleThreads<std::shared_mutex>(b.work, &mutex, stop, count, hist,
+                                           readPct);
+      }));
+  }
+  for (bool bypass : {false, true}) {
+    b.reporter->section(std::string("Running in a single thread with ") +
+                        (bypass ? "seqlock reads bypassing delegation, "
+                                : "delegation of reads and writes, ") +
+                        ratio + " reads:writes");
+    TableServer server(1024, b.howmuch);  // start the server thread
+    for (int j = 1; j <= b.threads; ++j) {
+      b.reporter->result(runPhase("read-write",
+                                  (bypass ? "seqlock/" : "delegation/") +
+                                  ratio, j, b.testTime,
+        [&](int i, auto stop, auto count, auto hist) {
+          readWriteClientThread(&server, i, readPct, bypass, stop, count,
+                                hist);
+        }));
+    }
+  }
+}
+
+// Run j client processes against server for testTime, plus one which
+// dies after a few requests if crash is set:
+PhaseResult runProcesses(ShmServer& server, ProcessResults* results, int j,
+                         bool crash, double testTime) {
+  std::chrono::high_resolution_clock clock;
+  PhaseResult r;
+  r.section = "processes";
+  r.variant = crash ? "crash" : "shm";
+  r.threads = j;
+  new (results) ProcessResults();
+  uint64_t reclaimedBefore = server.reclaimed();
+  std::cout.flush();
+  std::vector<pid_t> pids;
+  perf.start();
+  auto startTime = clock.now();
+  for (int i = 0; i < j + (crash ? 1 : 0); ++i) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      shmClientProcess(server.fileDescriptor(), results, i,
+                       i == j ? 10 : 0);
+      _exit(0);
+    }
+    if (pid > 0) {
+      pids.push_back(pid);
+    }
+  }
+  std::this_thread::sleep_for(std::chrono::duration<double>(testTime));
+  results->stop.store(1);
+  for (pid_t pid : pids) {
+    waitpid(pid, nullptr, 0);
+  }
+  auto endTime = clock.now();
+  perf.stop();
+  r.seconds = std::chrono::duration<double>(endTime - startTime).count();
+  for (int i = 0; i < j; ++i) {
+    r.counts.push_back(results->counts[i]);
+    r.ops += results->counts[i];
+    r.latency.merge(results->hists[i]);
+    r.maxWaits.push_back(results->hists[i].max());
+    resultSink.fetch_add(results->sums[i], std::memory_order_relaxed);
+  }
+  r.perfPerOp = perf.perOp(r.ops);
+  if (crash) {
+    // The server looks for dead clients every 10 ms:
+    for (int k = 0; k < 100 && server.reclaimed() == reclaimedBefore; ++k) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    r.note = " and a client process which dies";
+    r.extra.emplace_back("reclaimed_slots",
+                         server.reclaimed() - reclaimedBefore);
+  }
+  return r;
+}
+
+// Measure delegation from client processes through shared memory to a
+// server thread in this process, and whether the slot of a client process
+// which dies is taken back:
+void measureProcesses(Bench const& b) {
+  b.reporter->section(
+    "Running in a single thread with delegation from client processes");
+  ShmServer server(ProcessResults::maxProcesses, b.work);
+  void* p = mmap(nullptr, sizeof(ProcessResults), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (!server.valid() || p == MAP_FAILED) {
+    b.reporter->message("shared memory not available");
+    return;
+  }
+  ProcessResults* results = static_cast<ProcessResults*>(p);
+  int threads = std::min(b.threads, ProcessResults::maxProcesses - 1);
+  for (int j = 1; j <= threads; ++j) {
+    b.reporter->result(runProcesses(server, results, j, false, b.testTime));
+  }
+  b.reporter->result(runProcesses(server, results, threads, true,
+                                  b.testTime));
+  munmap(p, sizeof(ProcessResults));
+}
+
+// Measure how long the first request after an idle period takes, for a
+// server with idle policy p, and how much CPU the server burns meanwhile:
+void measureIdleWakeup(Bench const& b, char const* name, char const* variant,
+                       IdlePolicy p) {
+  std::chrono::high_resolution_clock clock;
+  b.reporter->section(std::string("Idle server which ") + name);
+  Server server(p);
+  Server::Client* cl = new Server::Client(b.work);
+  server.registerClient(cl);
+  size_t const rounds = 200;
+  std::chrono::duration<double> const gap(0.005);  // long enough to reach
+                                                   // the last idle stage
+  PhaseResult r;
+  r.section = "idle-wakeup";
+  r.variant = variant;
+  r.threads = 1;
+  double cpuBefore = server.cpuTime();
+  perf.start();
+  auto startTime = clock.now();
+  for (size_t i = 0; i < rounds; ++i) {
+    std::this_thread::sleep_for(gap);
+    uint64_t sendTsc = __rdtsc();
+    server.submit(cl).wait();
+    r.latency.record(__rdtsc() - sendTsc);
+  }
+  auto endTime = clock.now();
+  perf.stop();
+  r.seconds = std::chrono::duration<double>(endTime - startTime).count();
+  double cpu = server.cpuTime() - cpuBefore;
+  server.unregisterClient(cl);
+  r.ops = rounds;
+  r.counts.push_back(rounds);
+  r.perfPerOp = perf.perOp(rounds);
+  r.extra.emplace_back("server_busy_pct", floor(cpu / r.seconds * 100));
+  b.reporter->result(r);
+}
+
+// Measure pipelined delegation with depth requests in flight per client:
+void measurePipelined(Bench const& b, uint32_t depth) {
+  b.reporter->section("Running in a single thread with pipelined delegation, "
+                      + std::to_string(depth) + " requests in flight");
+  PipelinedServer server;  // start the server thread
+  for (int j = 1; j <= b.threads; ++j) {
+    b.reporter->result(runPhase("pipelined",
+                                "depth=" + std::to_string(depth), j,
+                                b.testTime,
+      [&](int, auto stop, auto count, auto hist) {
+        pipelinedClientThread(&server, b.work, depth, stop, count, hist);
+      }));
+  }
+}
+
+// Measure delegation from threads which each interleave coros coroutines:
+void measureCoroutines(Bench const& b, int coros) {
+  b.reporter->section("Running in a single thread with delegation from " +
+                      std::to_string(coros) + " coroutines per thread");
+  Server server;  // start the server thread
+  for (int j = 1; j <= b.threads; ++j) {
+    b.reporter->result(runPhase("coroutine",
+                                "coros=" + std::to_string(coros), j,
+                                b.testTime,
+      [&](int, auto stop, auto count, auto hist) {
+        coroutineClientThread(&server, b.work, coros, stop, count, hist);
+      }));
+  }
+}
+
+// Measure typed delegation of operations with arguments and results:
+void measureTyped(Bench const& b) {
+  b.reporter->section("Running in a single thread with typed delegation");
+  CountingServer server(1024, b.howmuch);  // start the server thread
+  for (int j = 1; j <= b.threads; ++j) {
+    b.reporter->result(runPhase("typed", "", j, b.testTime,
+      [&](int i, auto stop, auto count, auto hist) {
+        typedClientThread(&server, i, stop, count, hist);
+      }));
+  }
+}
+
+// Measure delegation while as many other threads as there are working
+// clients keep connecting and disconnecting. The churning threads are the
+// second half of the phase and are reported as connects:
+void measureChurn(Bench const& b) {
+  b.reporter->section(
+    "Running in a single thread with delegation and client churn");
+  Server server;  // start the server thread
+  for (int j = 1; j <= b.threads; ++j) {
+    PhaseResult r = runPhase("churn", "", 2 * j, b.testTime,
+      [&](int i, auto stop, auto count, auto hist) {
+        if (i < j) {
+          clientThread<SpinWait>(&server, b.work, stop, count, hist);
+        } else {
+          churnThread(&server, b.work, stop, count);
+        }
+      });
+    uint64_t connects = 0;
+    for (int i = j; i < 2 * j; ++i) {
+      connects += r.counts[i];
+    }
+    r.counts.resize(j);
+    r.ops -= connects;
+    r.threads = j;
+    r.perfPerOp = perf.perOp(r.ops);
+    r.note = " and " + std::to_string(j) + " churning threads";
+    r.extra.emplace_back("connects", connects);
+    r.extra.emplace_back("ns_per_connect",
+                         floor(r.seconds / connects * 1e9));
+    b.reporter->result(r);
+  }
+}
+
+// Measure delegation with idle clients registered next to the working
+// ones, the server finds the pending requests with the given scan mode:
+void measureIdleClients(Bench const& b, ScanMode mode, int idleClients) {
+  b.reporter->section(std::string(
+    "Running in a single thread with delegation, ") +
+    (mode == ScanMode::Poll ? "polling " : "doorbells for ") +
+    std::to_string(idleClients) + " idle clients");
+  Server server(IdlePolicy::spin(), idleClients + b.threads + 64, mode);
+  std::vector<Server::Client*> idlers;
+  for (int i = 0; i < idleClients; ++i) {
+    idlers.push_back(new Server::Client(b.work));
+    server.registerClient(idlers[i]);
+  }
+  for (int j = 1; j <= b.threads; ++j) {
+    PhaseResult r = runPhase("idle-clients",
+                             mode == ScanMode::Poll ? "poll" : "doorbell", j,
+                             b.testTime,
+      [&](int, auto stop, auto count, auto hist) {
+        clientThread<SpinWait>(&server, b.work, stop, count, hist);
+      });
+    r.extra.emplace_back("idle_clients", idleClients);
+    b.reporter->result(r);
+  }
+  for (int i = 0; i < idleClients; ++i) {
+    server.unregisterClient(idlers[i]);
+  }
+}
+
+// Measure a delegating server with spinning clients, with the server and
+// the clients placed on the CPUs according to policy p:
+void measurePlacement(Bench const& b, std::vector<CpuInfo> const& topology,
+                      Placement p) {
+  b.reporter->section(
+    std::string("Running in a single thread with delegation, placement ") +
+    placementName(p));
+  if (placeThreads(topology, p, 1).empty()) {
+    b.reporter->message("not possible on this machine");
+    return;
+  }
+  Server server;  // start the server thread
+  for (int j = 1; j <= b.threads; ++j) {
+    std::vector<int> cpus = placeThreads(topology, p, j);
+    if (cpus.empty()) {
+      // Clients sharing a CPU would measure time slices, not coherence:
+      b.reporter->message("not possible for more than " +
+                          std::to_string(j - 1) + " clients on this machine");
+      break;
+    }
+    server.pin(cpus[0]);
+    PhaseResult r = runPhase("placement", placementName(p), j, b.testTime,
+      [&](int i, auto stop, auto count, auto hist) {
+        // Pin before the client allocates and registers its slot, so that
+        // the slot is first touched on the client's NUMA node:
+        pinThread(pthread_self(), cpus[i + 1]);
+        clientThread<SpinWait>(&server, b.work, stop, count, hist);
+      });
+    if (cpus[0] >= 0) {
+      r.note = ", server on CPU " + std::to_string(cpus[0]) +
+               ", clients on CPUs";
+      for (int i = 1; i <= j; ++i) {
+        r.note += ' ';
+        r.note += std::to_string(cpus[i]);
+      }
+    }
+    b.reporter->result(r);
+  }
+}
+
+// Measure the latency against the offered load for open-loop clients on
+// the mutex and on the delegation path. Both do one piece of work at a
+// time, so 1 / workTime is their capacity, and the offered load is swept
+// as a fraction of it until the achieved rate falls behind:
+void measureOpenLoop(Bench const& b, bool poisson) {
+  static double const loads[] = {0.1, 0.25, 0.5, 0.7, 0.8, 0.9, 0.95, 1.0,
+                                 1.1, 1.25};
+  std::string arrivals = poisson ? "poisson" : "constant";
+  double capacity = 1.0 / workTime;
+  int j = b.threads;
+  for (std::string path : {"mutex", "delegation"}) {
+    b.reporter->section("Running open loop with " + arrivals +
+                        " arrivals from " + std::to_string(j) +
+                        " clients against " +
+                        (path == "mutex" ? "a std::mutex" : "delegation"));
+    std::mutex mutex;
+    std::optional<Server> server;   // only for delegation, an idle one
+                                    // would burn a core next to the mutex
+    if (path == "delegation") {
+      server.emplace();             // start the server thread
+    }
+    for (double load : loads) {
+      double rate = load * capacity;
+      PhaseResult r = runPhase("open-loop", path + "/" + arrivals, j,
+                               b.testTime,
+        [&](int i, auto stop, auto count, auto hist) {
+          // Spread the first requests of the clients over one interval:
+          double interval = tscPerNs * 1e9 / (rate / j);
+          Arrivals a(poisson, rate / j,
+                     __rdtsc() + static_cast<uint64_t>(interval * i / j),
+                     0x9e3779b97f4a7c15ULL * (i + 1));
+          if (path == "mutex") {
+            openLoopClient(a, [&]() {
+              std::unique_lock<std::mutex> guard(mutex);
+              b.work->dowork();
+            }, stop, count, hist);
+          } else {
+            Server::Client* cl = new Server::Client(b.work);
+            server->registerClient(cl);
+            openLoopClient(a, [&]() {
+              server->submit(cl).wait();
+            }, stop, count, hist);
+            server->unregisterClient(cl);
+          }
+        });
+      double achieved = r.ops / r.seconds;
+      r.note = ", offered " + pretty(static_cast<uint64_t>(rate)) +
+               " requests/s (" + std::to_string(static_cast<int>(load * 100))
+               + "% of capacity)";
+      r.extra.emplace_back("offered_per_s", floor(rate));
+      r.extra.emplace_back("achieved_per_s", floor(achieved));
+      r.extra.emplace_back("load", load);
+      b.reporter->result(r);
+      if (achieved < 0.95 * rate) {
+        b.reporter->message("saturated");
+        break;
+      }
+    }
+  }
+}
+
+// Measure flat combining without a dedicated server thread:
+void measureCombining(Bench const& b) {
+  b.reporter->section("Running with flat combining");
+  Combiner combiner;
+  for (int j = 1; j <= b.threads; ++j) {
+    b.reporter->result(runPhase("combining", "", j, b.testTime,
+      [&](int, auto stop, auto count, auto hist) {
+        combinerThread(&combiner, b.work, stop, count, hist);
+      }));
+  }
+}
+
+// Measure sharded delegation with 1 to servers server threads, each
+// owning its own part of the data:
+void measureSharded(Bench const& b, int servers) {
+  b.reporter->section("Running with sharded delegation");
+  for (int k = 1; k <= servers; ++k) {
+    std::vector<std::unique_ptr<Work>> shards;
+    std::vector<std::unique_ptr<Server>> serverList;
+    for (int s = 0; s < k; ++s) {
+      shards.emplace_back(new Work(b.work->getKind(), b.howmuch,
+                                   b.work->getFootprint() / k));
+      serverList.emplace_back(new Server());  // starts a server thread
+    }
+    for (int j = 1; j <= b.threads; ++j) {
+      PhaseResult r = runPhase("sharded", "servers=" + std::to_string(k), j,
+                               b.testTime,
+        [&](int i, auto stop, auto count, auto hist) {
+          shardedClientThread(&serverList, &shards, stop, count, hist,
+                              0x9e3779b97f4a7c15ULL * (i + 1));
+        });
+      r.note = " and " + std::to_string(k) + " servers";
+      b.reporter->result(r);
+    }
+    for (int s = 0; s < k; ++s) {
+      resultSink.fetch_add(shards[s]->get(), std::memory_order_relaxed);
+    }
+  }
+}
+
+char const* const allModes[] = {
+  "single", "lock", "delegation", "combining", "churn", "placement",
+  "idle-clients", "typed", "coroutine", "pipelined", "idle-wakeup", "sharded",
+  "open-loop", "batch", "transport", "elastic", "read-write", "processes",
+  "payload", "slot-pool", "layout", "fairness"
+};
+char const* const allProtocols[] = {"tick", "what"};
+char const* const allWaits[] = {"spin", "yield", "park"};
+char const* const allWorkloads[] = {"sum", "hashmap", "pqueue", "chase",
+                                    "fifo"};
+char const* const allArrivals[] = {"poisson", "constant"};
+char const* const allLocks[] = {"mutex", "ttas", "ticket", "mcs", "clh",
+                                "futex"};
+
+// Command line options:
+struct Options {
+  size_t howmuch = 0;
+  double testTime = 0.0;
+  int threads = 0;
+  int servers = 1;
+  std::vector<std::string> modes;     // empty means all of them
+  std::vector<std::string> protocols{"tick"};
+  std::vector<std::string> waits{std::begin(allWaits), std::end(allWaits)};
+  std::vector<std::string> locks{std::begin(allLocks), std::end(allLocks)};
+  std::vector<std::string> arrivals{"poisson"};
+  WorkKind workload = WorkKind::Sum;
+  size_t footprint = 1 << 20;
+  Format format = Format::Text;
+
+  static bool contains(std::vector<std::string> const& l,
+                       std::string const& s) {
+    for (std::string const& x : l) {
+      if (x == s) {
+        return true;
       }
-      std::cout << "  time="
-        << runTime.count() << "s " << pretty(count)
-        << " iterations, time per iteration: "
-        << floorl(runTime.count() / static_cast<double>(count) * 1e9) << " ns"
+    }
+    return false;
+  }
+
+  bool runs(std::string const& mode) const {
+    return modes.empty() || contains(modes, mode);
+  }
+};
+
+void usage() {
+  std::cerr << "Usage: servertest DIFFICULTY TESTTIME THREADS [SERVERS] "
+    "[OPTIONS]\n"
+    "Options:\n"
+    "  --mode=LIST      measurements to run, default all of single,lock,\n"
+    "                   delegation,combining,churn,placement,idle-clients,\n"
+    "                   typed,coroutine,pipelined,idle-wakeup,sharded,\n"
+    "                   open-loop,batch,transport,elastic,read-write,\n"
+    "                   processes,payload,slot-pool,layout,fairness\n"
+    "  --server=LIST    delegation protocols, tick and/or what, default tick\n"
+    "  --wait=LIST      client wait strategies, default spin,yield,park\n"
+    "  --lock=LIST      locks, default mutex,ttas,ticket,mcs,clh,futex\n"
+    "  --arrivals=LIST  open-loop schedules, poisson and/or constant,\n"
+    "                   default poisson\n"
+    "  --workload=W     sum, hashmap, pqueue, chase or fifo, default sum\n"
+    "  --footprint=N    bytes of shared data for the workload, K, M or G\n"
+    "                   may follow, default 1M\n"
+    "  --format=F       text, json or csv, default text" << std::endl;
+}
+
+// Split a comma separated list and check that all entries are allowed:
+template <size_t N>
+bool parseList(std::string const& option, std::string const& value,
+               char const* const (&allowed)[N],
+               std::vector<std::string>& list) {
+  list.clear();
+  std::stringstream ss(value);
+  std::string entry;
+  while (std::getline(ss, entry, ',')) {
+    if (!Options::contains(std::vector<std::string>(allowed, allowed + N),
+                           entry)) {
+      std::cerr << "Unknown value '" << entry << "' for " << option
         << std::endl;
-      std::cout << "  thread counts:";
-      for (int i = 0; i < j; ++i) {
-        std::cout << " " << pretty(counts[i]);
+      return false;
+    }
+    list.push_back(entry);
+  }
+  return true;
+}
+
+// Parse the command line into o, complains and returns false if it is
+// not valid:
+bool parseOptions(int argc, char* argv[], Options& o) {
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 2, "--") != 0) {
+      positional.push_back(arg);
+      continue;
+    }
+    size_t eq = arg.find('=');
+    std::string option = arg.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+    bool ok = true;
+    if (option == "--mode") {
+      ok = parseList(option, value, allModes, o.modes);
+    } else if (option == "--server") {
+      ok = parseList(option, value, allProtocols, o.protocols);
+    } else if (option == "--wait") {
+      ok = parseList(option, value, allWaits, o.waits);
+    } else if (option == "--lock") {
+      ok = parseList(option, value, allLocks, o.locks);
+    } else if (option == "--arrivals") {
+      ok = parseList(option, value, allArrivals, o.arrivals);
+    } else if (option == "--workload") {
+      std::vector<std::string> w;
+      ok = parseList(option, value, allWorkloads, w) && w.size() == 1;
+      for (WorkKind k : {WorkKind::Sum, WorkKind::HashMap,
+                         WorkKind::PriorityQueue, WorkKind::PointerChase,
+                         WorkKind::Fifo}) {
+        if (ok && w[0] == workKindName(k)) {
+          o.workload = k;
+        }
+      }
+    } else if (option == "--footprint") {
+      size_t pos = 0;
+      try {
+        o.footprint = std::stoul(value, &pos);
+      } catch (std::exception const&) {
+        std::cerr << "Invalid size " << value << std::endl;
+        ok = false;
+      }
+      std::string suffix = ok ? value.substr(pos) : "";
+      if (suffix == "K") {
+        o.footprint <<= 10;
+      } else if (suffix == "M") {
+        o.footprint <<= 20;
+      } else if (suffix == "G") {
+        o.footprint <<= 30;
+      } else if (!suffix.empty()) {
+        std::cerr << "Unknown size suffix " << suffix << std::endl;
+        ok = false;
+      }
+    } else if (option == "--format" && value == "text") {
+      o.format = Format::Text;
+    } else if (option == "--format" && value == "json") {
+      o.format = Format::Json;
+    } else if (option == "--format" && value == "csv") {
+      o.format = Format::Csv;
+    } else {
+      std::cerr << "Unknown option " << arg << std::endl;
+      ok = false;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  if (positional.size() < 3 || positional.size() > 4) {
+    return false;
+  }
+  try {
+    o.howmuch = std::stoul(positional[0]);
+    o.testTime = std::stod(positional[1]);
+    o.threads = std::stol(positional[2]);
+    o.servers = positional.size() > 3 ? std::stol(positional[3]) : 1;
+  } catch (std::exception const&) {
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  // Command line arguments:
+  Options opts;
+  if (!parseOptions(argc, argv, opts)) {
+    usage();
+    return 1;
+  }
+
+  // Hardware performance counters, before any thread is started:
+  perf.open();
+
+  // Work generator:
+  Work work(opts.workload, opts.howmuch, opts.footprint);
+  std::chrono::high_resolution_clock clock;
+
+  // Measure a single workload:
+  {
+    size_t repeats = 100;
+    std::chrono::duration<double> runTime;
+    while (true) {
+      auto startTime = clock.now();
+      for (size_t i = 0; i < repeats; ++i) {
+        work.dowork();
+      }
+      auto endTime = clock.now();
+      runTime = endTime - startTime;
+      if (runTime > std::chrono::duration<double>(1)) {
+        break;
+      }
+      repeats *= 3;
+    }
+    workTime = runTime.count() / repeats;
+  }
+
+  // Gauge how long a parking client should spin and how fast the TSC is:
+  double handoverNs = calibrateParking();
+  calibrateTsc();
+
+  std::vector<CpuInfo> topology = readTopology();
+  std::set<int> cores, llcs, packages;
+  for (CpuInfo const& c : topology) {
+    cores.insert(c.core);
+    llcs.insert(c.llc);
+    packages.insert(c.package);
+  }
+
+  Reporter reporter(opts.format);
+  reporter.begin({
+    {"difficulty", std::to_string(opts.howmuch)},
+    {"test_time", std::to_string(opts.testTime)},
+    {"threads", std::to_string(opts.threads)},
+    {"servers", std::to_string(opts.servers)},
+    {"workload", workKindName(opts.workload)},
+    {"footprint", std::to_string(opts.footprint)},
+    {"work_time_ns", std::to_string(static_cast<uint64_t>(workTime * 1e9))},
+    {"futex_handover_ns", std::to_string(static_cast<uint64_t>(handoverNs))},
+    {"park_spins", std::to_string(parkSpins)},
+    {"tsc_per_ns", std::to_string(tscPerNs)},
+    {"cpus", std::to_string(topology.size())},
+    {"cores", std::to_string(cores.size())},
+    {"llcs", std::to_string(llcs.size())},
+    {"sockets", std::to_string(packages.size())},
+    {"perf_counters", perf.names()}
+  });
+  Bench bench{&reporter, &work, opts.howmuch, opts.threads, opts.servers,
+              opts.testTime};
+
+  // Now measure how many workloads a single thread can do in a given time:
+  if (opts.runs("single")) {
+    measureSingle(bench);
+  }
+
+  // Now measure how multiple threads fare when using locks:
+  if (opts.runs("lock")) {
+    for (std::string const& l : opts.locks) {
+      if (l == "mutex") {
+        measureLock<std::mutex>(bench, "a std::mutex", "mutex");
+      } else if (l == "ttas") {
+        measureLock<TTASLock>(bench, "a TTAS lock with backoff", "ttas");
+      } else if (l == "ticket") {
+        measureLock<TicketLock>(bench, "a ticket lock", "ticket");
+      } else if (l == "mcs") {
+        measureLock<MCSLock>(bench, "an MCS lock", "mcs");
+      } else if (l == "clh") {
+        measureLock<CLHLock>(bench, "a CLH lock", "clh");
+      } else if (l == "futex") {
+        measureLock<FutexLock>(bench, "a futex lock", "futex");
+      }
+    }
+  }
+
+  // Measure the delegating servers with the different wait strategies:
+  if (opts.runs("delegation")) {
+    for (std::string const& p : opts.protocols) {
+      for (std::string const& w : opts.waits) {
+        if (w == "spin") {
+          measureDelegation<SpinWait>(bench, p, w, "spinning clients");
+        } else if (w == "yield") {
+          measureDelegation<YieldWait>(bench, p, w, "yielding clients");
+        } else if (w == "park") {
+          measureDelegation<ParkWait>(bench, p, w, "parking clients");
+        }
       }
-      std::cout << "\n" << std::endl;
     }
   }
 
+  // Measure flat combining without a dedicated server thread:
+  if (opts.runs("combining")) {
+    measureCombining(bench);
+  }
+
+  // Measure delegation while clients connect and disconnect all the time:
+  if (opts.runs("churn")) {
+    measureChurn(bench);
+  }
+
+  // Measure how the placement of server and clients on the CPUs affects
+  // the delegation round trip:
+  if (opts.runs("placement")) {
+    for (Placement p : {Placement::OsDefault, Placement::SameCore,
+                        Placement::SameLlc, Placement::CrossSocket,
+                        Placement::CrossNode}) {
+      measurePlacement(bench, topology, p);
+    }
+  }
+
+  // Measure how the server copes with many idle and a few hot clients:
+  if (opts.runs("idle-clients")) {
+    measureIdleClients(bench, ScanMode::Poll, 500);
+    measureIdleClients(bench, ScanMode::Doorbell, 500);
+  }
+
+  // Measure typed delegation of operations on a real data structure:
+  if (opts.runs("typed")) {
+    measureTyped(bench);
+  }
+
+  // Measure delegation from coroutines, several requests in flight per
+  // thread, against the spinning clients above:
+  if (opts.runs("coroutine")) {
+    measureCoroutines(bench, 4);
+  }
+
+  // Measure pipelined delegation with several requests in flight:
+  if (opts.runs("pipelined")) {
+    measurePipelined(bench, 4);
+    measurePipelined(bench, PipelinedServer::ringSize);
+  }
+
+  // Measure what the idle stages of the server add to the latency of the
+  // first request after an idle period:
+  if (opts.runs("idle-wakeup")) {
+    measureIdleWakeup(bench, "keeps spinning", "spin", IdlePolicy::spin());
+    measureIdleWakeup(bench, "backs off with pause", "pause",
+                      IdlePolicy::pause());
+    measureIdleWakeup(bench, "backs off and sleeps", "sleep",
+                      IdlePolicy::sleeping());
+  }
+
+  // Measure sharded delegation with several server threads, each owning
+  // its own part of the data:
+  if (opts.runs("sharded") && opts.servers > 1) {
+    measureSharded(bench, opts.servers);
+  }
+
+  // Measure how much batching the requests of a pass lifts the throughput
+  // of the server:
+  if (opts.runs("batch")) {
+    measureBatching(bench);
+  }
+
+  // Measure the MPSC queue transport against polling the client slots:
+  if (opts.runs("transport")) {
+    measureTransport(bench);
+  }
+
+  // Measure how an elastic pool of servers follows a changing load:
+  if (opts.runs("elastic") && opts.servers > 1) {
+    measureElastic(bench);
+  }
+
+  // Measure what letting reads bypass the server gains over delegating
+  // them and over locks:
+  if (opts.runs("read-write")) {
+    for (unsigned readPct : {50, 90, 99}) {
+      measureReadWrite(bench, readPct);
+    }
+  }
+
+  // Measure delegation across process boundaries:
+  if (opts.runs("processes")) {
+    measureProcesses(bench);
+  }
+
+  // Measure where inline payloads stop paying off against an arena:
+  if (opts.runs("payload")) {
+    measurePayload(bench);
+  }
+
+  // Measure the scan over heap slots against pooled hugepage slots:
+  if (opts.runs("slot-pool")) {
+    measureSlotPool(bench);
+  }
+
+  // Measure the slot layouts against the number of clients:
+  if (opts.runs("layout")) {
+    measureLayout<PaddedSlots>(bench);
+    measureLayout<PackedSlots>(bench);
+    measureLayout<SplitSlots>(bench);
+  }
+
+  // Measure whether bulk clients starve latency critical ones under each
+  // schedule:
+  if (opts.runs("fairness")) {
+    measureFairness(bench);
+  }
+
+  // Measure latency against offered load with open-loop clients:
+  if (opts.runs("open-loop")) {
+    for (std::string const& a : opts.arrivals) {
+      measureOpenLoop(bench, a == "poisson");
+    }
+  }
+
+  reporter.end();
+
   // Write out dummy result to convince compiler not to optimize everything out
   {
     std::fstream dummys("/dev/null", std::ios_base::out);
     dummys << work.get() << std::endl;
+    dummys << resultSink.load() << std::endl;
   }
 }